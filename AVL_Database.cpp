@@ -1,341 +1,1391 @@
 #include "AVL_Database.hpp"
-#include <cstdlib>   // for abs() in doBalance()
 #include <iostream>
-#include <queue>   //for priority_queue (heaps) in findKNearestKeys()
-#include <algorithm>    //for reverse() in findKNearestKeys()
+#include <climits>  //for LLONG_MAX in FrozenIndex::findKNearestKeys()
+#include <algorithm>    //for reverse() in FrozenIndex::findKNearestKeys(), stable_sort()/is_sorted() in bulk loading
+#include <cmath>    //for ceil() in percentile()
+#include <cstdint>  //for uintptr_t in FrozenIndex
+#include <cstddef>  //for offsetof() of the snapshot header fields
+#include <cstring>  //for memcpy() in the log/snapshot encoders and KeyArena
+#include <stdexcept>    //for length_error when KeyArena runs out of ids
+#include <fcntl.h>  //for open() of log and snapshot files
+#include <unistd.h> //for write()/fdatasync()/ftruncate()
+#include <sys/mman.h>   //for mmap() in MappedSnapshot
+#include <sys/stat.h>   //for fstat() in MappedSnapshot
+#include <cerrno>   //for ENOENT in WriteAheadLog::replay()
+#include <sstream>  //for DatabaseStats::toText()/toJson()
 
-Record::Record(const std::string& k, int v) : key(k), value(v) {}
+Record::Record(std::string k, int v) : key(std::move(k)), value(v) {}
 
-AVLNode::AVLNode(Record* r) : record(r), left(nullptr), right(nullptr), height(1) {}
+#ifdef AVL_INTERNED_KEYS
+//Never destroyed: records in other statics may release their keys after it would have been
+KeyArena& KeyArena::instance() {
+    static KeyArena* arena = new KeyArena();    //constructed on first use, thread-safe
+    return *arena;
+}
 
-AVLTree::AVLTree() : root(nullptr) {}
+KeyArena::KeyArena() : chunkUsed(0), chunkSize(0), usedBytes(0), used(0) {
+    for(auto& chunk : chunkTable)
+        chunk.store(nullptr, std::memory_order_relaxed);
+    grow(); //so lookups always have a table to probe
+    intern(""); //id 0, what a default InternedKey holds, never released
+}
 
-int AVLTree::height(AVLNode* node) const {
-    return node ? node->height : 0;
+//An entry is its reference count, its length, then the bytes, padded so the next count stays aligned
+size_t KeyArena::entrySize(size_t length) {
+    return (2 * sizeof(uint32_t) + length + alignof(uint32_t) - 1) & ~(alignof(uint32_t) - 1);
 }
 
-int AVLTree::balance(AVLNode* node) const {
-    return node ? height(node->left) - height(node->right) : 0;
+std::atomic<uint32_t>& KeyArena::refs(uint32_t id) const {
+    return *reinterpret_cast<std::atomic<uint32_t>*>(const_cast<char*>(data(id)) - 2 * sizeof(uint32_t));
 }
 
-/*  Check balance of node, balancing it with rotations if required.  Assumes node exists (would be simple to change so this assumption is not necessary).
-    Recursive function, gets passed node to balance and returns balanced node.
-*/
-AVLNode* AVLTree::doBalance(AVLNode* a) {
-    //recursively propagates down whichever side is unbalanced until it fails (can't go further), at which point it is at a the source of the unbalance
-    //recursive case 1: unbalanced left or right child
-    if(abs(balance(a->left)) > 1) { 
-        a->left = doBalance(a->left);
-    }
-    if(abs(balance(a->right)) > 1) {
-        a->right = doBalance(a->right);
+const char* KeyArena::data(uint32_t id) const {
+    return chunkTable[id >> CHUNK_BITS].load(std::memory_order_acquire) + (id & (CHUNK_BYTES - 1)) + 2 * sizeof(uint32_t);
+}
+
+size_t KeyArena::find(std::string_view key, uint32_t hash) const {
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    while(slots[i].id != NO_ID) {
+        if(slots[i].hash == hash) { //compare hashes first, bytes only on a hash match
+            const char* bytes = data(slots[i].id);
+            uint32_t length;
+            std::memcpy(&length, bytes - sizeof(length), sizeof(length));
+            if(std::string_view(bytes, length) == key)
+                return i;
+        }
+        i = (i + 1) & mask;
     }
-    
-    //base case 2: at the source of the unbalance, rotate to eliminate unbalance
-    //recursive case 1a: if/when rotation of children from recursive calls are done, check if this node is still unbalanced and balance if necessary.
-    if(balance(a) > 1) {    //unbalanced to the left
-        if(balance(a->left) >= 0)   //two if cases filter to unbalanced on single side, only one rotation necessary
-            return rotateRight(a);
-        else {  //else is unbalanced to the left but left child is unbalanced to the right, which requires two rotations
-            a->left = rotateLeft(a->left);
-            return rotateRight(a);
+    return i;
+}
+
+//Empties slot i, shifting later slots of the same probe run back so every key stays reachable from its home slot
+void KeyArena::erase(size_t i) {
+    size_t mask = slots.size() - 1;
+    for(size_t j = (i + 1) & mask; slots[j].id != NO_ID; j = (j + 1) & mask) {
+        size_t home = slots[j].hash & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)) {   //i lies between j's home and j, so j can move up to it
+            slots[i] = slots[j];
+            i = j;
         }
-    } else if(balance(a) < -1) {    //unbalanced to the right
-        if(balance(a->right) <=0)   //two if cases filter to unbalanced on signel side, only one rotation necessary
-            return rotateLeft(a);
-        else {  //else is unbalanced to the right but right child is unbalanced to the left, which requires two rotations
-            a->right = rotateRight(a->right);
-            return rotateLeft(a);
+    }
+    slots[i].id = NO_ID;
+}
+
+//Doubles the table (min 1024 slots) and reinserts every id using its stored hash
+void KeyArena::grow() {
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.assign(old.empty() ? 1024 : old.size() * 2, Slot{0, NO_ID});
+    for(auto& slot : old) {
+        if(slot.id != NO_ID) {
+            size_t i = slot.hash & (slots.size() - 1);
+            while(slots[i].id != NO_ID)
+                i = (i + 1) & (slots.size() - 1);
+            slots[i] = slot;
         }
-    } else {    //else not unbalanced (perfectly balanced -Thanos)
-        updateHeight(a);    //necessary to propagate height changes from rebalance up the tree during Recursive case 1 doing balance down the tree but node itself is still balanced
-        return a;
     }
 }
 
-//Assumes node exists, designed to be used in recursive functions to propagate in post-order fashion.  Could be changed so assumption not necessary and be solidly recursive-friendly
-void AVLTree::updateHeight(AVLNode* node) {
-    if(height(node->left) >= height(node->right))   //correctly calculates height even with null nodes in left or right or both
-        node->height = height(node->left) + 1;
-    else
-        node->height = height(node->right) + 1;
-}
-
-//Assumes y->left exists (a good assumption since this is (only?) called when y is unbalanced to the left)
-AVLNode* AVLTree::rotateRight(AVLNode* y) {
-    //setup temp pointers prior to performing rotation
-    AVLNode* yLeft = y->left;
-    AVLNode* yLeftRight;
-    if(y->left)
-        yLeftRight = yLeft->right;
-    else    
-        std::cout << "Error: Expected y->left exist but not.";
-    //perform rotation with temp pointer assistance
-    yLeft->right = y;
-    y->left = yLeftRight;
-
-    //update the two heights necessary (yLeftRight not necessary because its children aren't modified)
-    updateHeight(y);
-    updateHeight(yLeft);
-
-    return yLeft;   //was passed node, now return correctly rotated node
-}
-
-//Assumes x->right exists (a good assumption since this is (only?) called when y is unbalanced to the right)
-AVLNode* AVLTree::rotateLeft(AVLNode* x) {
-    //setup temp pointers prior to performing rotation
-    AVLNode* xRight = x->right;
-    AVLNode* xRightLeft;
-    if(x->right)
-        xRightLeft = xRight->left;
-    else    
-        std::cout << "Error: Expected x->right exist but not.";
-    //perform rotation with temp pointer assistance
-    xRight->left = x;
-    x->right = xRightLeft;
-
-    //update the two heights necessary (xRightLeft not necessary because its children aren't modified)
-    updateHeight(x);
-    updateHeight(xRight);
-
-    return xRight;  //was passed node, now return correctly rotated node
-}
-
-
-
-void AVLTree::insert(Record* record) {
-    //you can make a private memeber function to handle insertion.
-    //e.g root = insertHelper(root, record);
-    root = insertHelper(root, record);  
-    root = doBalance(root); //balance with recursive function
-}
-
-//Recursively travels down the tree based on value until it reaches a null (and thus available) node and places new node there.  Also updates height up the tree as part of recursion.
-AVLNode* AVLTree::insertHelper(AVLNode* node, Record* r) {
-    if(!node) { //base case 1: called on empty node
-        AVLNode* newNode = new AVLNode(r);  //create the new node with passed record
-        return newNode; //return the new node for parent to attach
-    } else {    //recursive case 2 & 3
-        if(node->record->value > r->value) {    //recursive case 2: r's value is less than node's record's value
-            node->left = insertHelper(node->left, r);   //propagate insertion down node's left side
-            if(height(node->left) >= height(node))  //updates height up the entire chain if necessary (doesn't update height if height was added to the lesser side)
-                node->height++; //(by adding to self node's height if insertion down the side added to height)
-        } else {    //recursive case 3: r's value is larger than (or equal to, but that doesn't happen) node's record's value
-            node->right = insertHelper(node->right, r); //propagate insertion down node's right side
-            if(height(node->right) >= height(node)) //updates height up the entire chain if necessary
-                node->height++;
+//Writes key into a released entry of the same size if there is one, else at the end of the newest chunk.  Caller
+//holds the lock exclusively
+uint32_t KeyArena::allocate(std::string_view key) {
+    uint32_t length = key.size();
+    size_t need = entrySize(length);
+    uint32_t id;
+    auto reuse = freeIds.find(need);
+    if(reuse != freeIds.end() && !reuse->second.empty()) {
+        id = reuse->second.back();
+        reuse->second.pop_back();
+    } else {
+        if(chunks.empty() || chunkUsed + need > chunkSize) {    //start a new chunk, a key bigger than a chunk gets its own
+            if(chunks.size() == MAX_CHUNKS)
+                throw std::length_error("KeyArena: too many distinct key bytes for 32-bit ids");
+            chunkSize = need > CHUNK_BYTES ? need : CHUNK_BYTES;
+            chunks.emplace_back(new char[chunkSize]);
+            chunkUsed = 0;
         }
-        return node;    //return self node (with possibly updated height) for recursion
-    }
-}
-
-Record* AVLTree::search(const std::string& key, int value) const {
-        return searchHelper(root, key, value);
-}
-
-//Recursive helpter for search, returns empty new record if not found
-Record* AVLTree::searchHelper(AVLNode* node, const std::string& key, int value) const {
-    if(!node) {   //base case 1: goes down the tree until the end with no match found
-        Record* newRecord = new Record("", 0);
-        return newRecord;
-    }
-    if(node->record->key == key && node->record->value == value)    //base case 2: key/value match found
-        return node->record;
-    else if(value < node->record->value)    //recursive case: go down left if value lower
-        return searchHelper(node->left, key, value);
-    else                                    //recursive case: go down right if value higher
-        return searchHelper(node->right, key, value);
-}
-
-void AVLTree::deleteNode(const std::string& key, int value) {
-    root = deleteHelper(root, key, value);  //assigning the returned node allows us to keep control
-                                            //on the chain of modification
-    if(root) {
-        //updateHeight(root);
-        doBalance(root);
-    }
-
-}
-
-//Recursive helper for deleteNode.  Note: returns the node/subtree that should be there after deletion, as expected by caller
-AVLNode* AVLTree::deleteHelper(AVLNode* node, const std::string& key, int value) {
-    if(!node)   //base case 1: recursion led us to the end of tree without match 
-        return nullptr; //node is nullptr, return also nullptr
-    if(node->record->value == value && node->record->key == key) {  //base case 2: matching node found
-        if(node->left && node->right) { //base case 2a: node has both left and right subtrees
-            AVLNode *curr = node->right;
-            while(curr->left) {
-                //prev = curr;  //don't need prev actually
-                curr = curr->left;
-            }   //at the end of the while, curr points to node's successor (by value) //and prev points to curr's parent
-            node->record = curr->record;  //point/replace node record to record of successor (curr)
-            node->right = deleteHelper(node->right, curr->record->key, curr->record->value);    //delete original successor
-            updateHeight(node); //update height after successor node deleted
-            return node;    //return node that has been replaced by successor values
-        } else if(node->left || node->right) {  //base case 2b: node has only left subtree, or only right subtree
-            AVLNode* temp;  //use temp to skip node and point to singular child
-            if(node->left)
-                temp = node->left;
-            else if(node->right)
-                temp = node->right;
-            delete node;
-            //no updateHeight necessary, temp's height does not change and caller will propagate height changes
-            return temp;    //return skipped-to node 
-        } else {    //base case 2c: node has neither left or right, and is a leaf node
-            delete node;
-            return nullptr;
+        id = ((chunks.size() - 1) << CHUNK_BITS) | chunkUsed;
+        new (chunks.back().get() + chunkUsed) std::atomic<uint32_t>(0);
+        chunkTable[chunks.size() - 1].store(chunks.back().get(), std::memory_order_release);  //the id only escapes after this
+        chunkUsed += need;
+    }
+    char* bytes = const_cast<char*>(data(id));
+    std::memcpy(bytes - sizeof(length), &length, sizeof(length));
+    std::memcpy(bytes, key.data(), length);
+    refs(id).store(1, std::memory_order_relaxed);   //published to other threads by the lock
+    usedBytes += need;
+    used++;
+    return id;
+}
+
+//Id 0 ("") is never counted, so the reference counts only ever see real keys
+bool KeyArena::lookup(std::string_view key, uint32_t& id) const {
+    uint32_t hash = static_cast<uint32_t>(std::hash<std::string_view>()(key));
+    std::shared_lock<std::shared_mutex> shared(lock);
+    size_t i = find(key, hash);
+    if(slots[i].id == NO_ID)
+        return false;
+    id = slots[i].id;
+    if(id)  //a count can't reach 0 and be released while the lock is held shared
+        refs(id).fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+//Keys already interned, the common case with repeated keys, only take the lock shared
+uint32_t KeyArena::intern(std::string_view key) {
+    uint32_t id;
+    if(lookup(key, id))
+        return id;
+    uint32_t hash = static_cast<uint32_t>(std::hash<std::string_view>()(key));
+    std::unique_lock<std::shared_mutex> exclusive(lock);
+    if((used + 1) * 4 > slots.size() * 3)
+        grow();
+    size_t i = find(key, hash);
+    if(slots[i].id != NO_ID) {  //interned by another thread in between
+        id = slots[i].id;
+        if(id)
+            refs(id).fetch_add(1, std::memory_order_relaxed);
+        return id;
+    }
+    id = allocate(key);
+    slots[i] = Slot{hash, id};
+    return id;
+}
+
+void KeyArena::acquire(uint32_t id) {
+    if(id)
+        refs(id).fetch_add(1, std::memory_order_relaxed);
+}
+
+//The count can go 0 -> 1 again (lookup()/intern() under the shared lock) before the exclusive lock is ours, and the
+//entry can even be released and reused by then, so it is only forgotten if its count is still 0 under the lock
+void KeyArena::release(uint32_t id) {
+    if(!id || refs(id).fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    std::unique_lock<std::shared_mutex> exclusive(lock);
+    if(refs(id).load(std::memory_order_relaxed) != 0)
+        return;
+    const char* bytes = data(id);
+    uint32_t length;
+    std::memcpy(&length, bytes - sizeof(length), sizeof(length));
+    std::string_view key(bytes, length);
+    erase(find(key, static_cast<uint32_t>(std::hash<std::string_view>()(key))));
+    refs(id).store(RELEASED, std::memory_order_relaxed);
+    size_t need = entrySize(length);
+    freeIds[need].push_back(id);
+    usedBytes -= need;
+    used--;
+}
+
+size_t KeyArena::count() const {
+    std::shared_lock<std::shared_mutex> shared(lock);
+    return used;
+}
+
+size_t KeyArena::bytes() const {
+    std::shared_lock<std::shared_mutex> shared(lock);
+    return usedBytes;
+}
+
+InternedKey::InternedKey() : id(0), length(0) {}
+
+InternedKey::InternedKey(std::string_view key) : id(KeyArena::instance().intern(key)), length(key.size()) {}
+
+InternedKey::InternedKey(uint32_t i, uint32_t l) : id(i), length(l) {}
+
+InternedKey::InternedKey(const InternedKey& other) : id(other.id), length(other.length) {
+    KeyArena::instance().acquire(id);
+}
+
+InternedKey::InternedKey(InternedKey&& other) noexcept : id(other.id), length(other.length) {
+    other.id = 0;
+    other.length = 0;
+}
+
+InternedKey& InternedKey::operator=(InternedKey other) noexcept {
+    std::swap(id, other.id);
+    std::swap(length, other.length);
+    return *this;
+}
+
+InternedKey::~InternedKey() {
+    KeyArena::instance().release(id);
+}
+
+bool InternedKey::lookup(std::string_view key, InternedKey& out) {
+    uint32_t found;
+    if(!KeyArena::instance().lookup(key, found))
+        return false;
+    out = InternedKey(found, key.size());
+    return true;
+}
+#endif
+
+KeyIndex::KeyIndex() : used(0) {}
+
+size_t KeyIndex::mask() const {
+    return slots.size() - 1;
+}
+
+//Doubles the table (min 16 slots) and reinserts every entry using its cached hash
+void KeyIndex::grow() {
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.assign(old.empty() ? 16 : old.size() * 2, Slot{0, nullptr});
+    for(auto& slot : old) {
+        if(slot.record) {
+            size_t i = slot.hash & mask();
+            while(slots[i].record)
+                i = (i + 1) & mask();
+            slots[i] = slot;
         }
-    } else {    //else node is not matching case
-        if(value < node->record->value) //recursive case 3: not matching node, value is less than node
-            node->left = deleteHelper(node->left, key, value);
-        else if(value > node->record->value)    //recursive case 4: not matching node, value is greater than node
-            node->right = deleteHelper(node->right, key, value);
-        updateHeight(node); //in case delete worked further down the recursion chain, propagate height changes post-order
-        return node;
     }
 }
 
-void AVLTree::deleteAll() {
-    deleteAllHelper(root);
-    root = nullptr;
+void KeyIndex::insert(Record* record) {
+    if((used + 1) * 2 > slots.size())   //keep load factor <= 1/2 so probe sequences stay short
+        grow();
+    size_t hash = std::hash<std::string_view>()(record->key);
+    size_t i = hash & mask();
+    while(slots[i].record)
+        i = (i + 1) & mask();
+    slots[i] = Slot{hash, record};
+    used++;
 }
 
-//Helper function that lets public deleteAll function access private root
-void AVLTree::deleteAllHelper(AVLNode* node) {
-    if(node) {  //recursive case: node exists, propagate to left and right branches
-        deleteAllHelper(node->left);
-        deleteAllHelper(node->right);
-        delete node;    //delete in post-order fashion
+Record* KeyIndex::find(std::string_view key) const {
+    if(used == 0)
+        return nullptr;
+    size_t hash = std::hash<std::string_view>()(key);
+    for(size_t i = hash & mask(); slots[i].record; i = (i + 1) & mask()) {
+        if(slots[i].hash == hash && slots[i].record->key == key)    //compare cached hashes first, strings only on a hash match
+            return slots[i].record;
     }
-    //base case: node does not exist/nullptr, do nothing
+    return nullptr;
 }
 
-std::vector<Record*> AVLTree::inorderTraversal() const {
-    return iotHelper(root);
+//Backward-shift deletion: after emptying the slot, pull later entries of the probe run back into the hole
+//whenever their home slot doesn't lie between the hole and where they sit, so lookups never need tombstones
+bool KeyIndex::erase(Record* record) {
+    if(used == 0)
+        return false;
+    size_t hash = std::hash<std::string_view>()(record->key);
+    size_t i = hash & mask();
+    while(slots[i].record && slots[i].record != record)
+        i = (i + 1) & mask();
+    if(!slots[i].record)    //not indexed
+        return false;
+    size_t hole = i;
+    for(size_t j = (hole + 1) & mask(); slots[j].record; j = (j + 1) & mask()) {
+        size_t home = slots[j].hash & mask();
+        if(((j - home) & mask()) >= ((j - hole) & mask())) {   //home is at or before hole, entry can move back
+            slots[hole] = slots[j];
+            hole = j;
+        }
+    }
+    slots[hole] = Slot{0, nullptr};
+    used--;
+    return true;
 }
 
-//Recursive helper function that lets public function access private root
-std::vector<Record*> AVLTree::iotHelper(AVLNode* a) const {
-    std::vector<Record*> out = {};  //need initalize to empty vector for base recursion cases
-    
-    if(!a)  //base case 1: a is nullptr, also happens when root is nullptr
-        return out; //return empty vector
+void KeyIndex::clear() {
+    slots.clear();
+    used = 0;
+}
 
-    //else recursive case 2: a exists, then propagate recursively down left and right sides (in in-order traversal)
-    if(a->left)
-        out = iotHelper(a->left);   //first set output vector to returned left-side vector
-    
-    out.push_back(a->record);   //second add a's record to output vector
-    
-    if(a->right) {
-        std::vector<Record*> temp = iotHelper(a->right); //need temp as second vector to allow insert() to combine two vectors
-        out.insert(out.end(), temp.begin(), temp.end());    //third add returned right-side vector (temp) to output vector
+size_t KeyIndex::size() const {
+    return used;
+}
+
+FrozenIndex::FrozenIndex() : eytzOffset(0) {}
+
+FrozenIndex::FrozenIndex(const std::vector<Record*>& sorted) : records(sorted) {
+    size_t n = sorted.size();
+    values.reserve(n);
+    for(auto r : sorted)
+        values.push_back(r->value);
+
+    const size_t LINE_INTS = 64 / sizeof(int);  //ints per cache line
+    eytzStorage.assign(n + 1 + LINE_INTS, 0);
+    size_t misalign = reinterpret_cast<uintptr_t>(eytzStorage.data()) % 64 / sizeof(int);
+    eytzOffset = misalign ? LINE_INTS - misalign : 0;   //slot 0 starts a cache line, so slots 16k..16k+15 share one
+    eytzRank.assign(n + 1, 0);
+    size_t next = 0;
+    fill(values, 1, next);
+}
+
+const int* FrozenIndex::eytz() const {
+    return eytzStorage.data() + eytzOffset;
+}
+
+//In-order walk of the implicit tree (children of slot k are 2k and 2k+1) hands out the sorted values in order
+void FrozenIndex::fill(const std::vector<int>& sorted, size_t k, size_t& next) {
+    if(k > sorted.size())
+        return;
+    fill(sorted, 2 * k, next);
+    eytzStorage[eytzOffset + k] = sorted[next];
+    eytzRank[k] = next++;
+    fill(sorted, 2 * k + 1, next);
+}
+
+//Branchless Eytzinger descent: go right while the slot is below value, then the answer is the last slot where we
+//went left, recovered by dropping the trailing right turns (trailing 1 bits) plus that left turn from k
+int FrozenIndex::lowerBound(int value) const {
+    const int* e = eytz();
+    size_t n = values.size(), k = 1;
+    while(k <= n) {
+#if defined(__GNUC__)
+        __builtin_prefetch(e + k * 16); //descendants four levels down sit in one cache line
+#endif
+        k = 2 * k + (e[k] < value);
     }
+    k >>= __builtin_ctzll(~k) + 1;
+    return k ? eytzRank[k] : n;
+}
+
+int FrozenIndex::upperBound(int value) const {
+    const int* e = eytz();
+    size_t n = values.size(), k = 1;
+    while(k <= n) {
+#if defined(__GNUC__)
+        __builtin_prefetch(e + k * 16);
+#endif
+        k = 2 * k + (e[k] <= value);
+    }
+    k >>= __builtin_ctzll(~k) + 1;
+    return k ? eytzRank[k] : n;
+}
+
+//Empty record ("", 0) the search() shims return on a miss.  One per thread, so concurrent readers never share it
+static Record* missingRecord() {
+    thread_local Record missing("", 0);
+    missing.key = {};   //caller may have modified the last one, an empty key never allocates
+    missing.value = 0;
+    return &missing;
+}
+
+Record* FrozenIndex::search(const std::string& key, int value) const {
+    if(Record* found = find(key, value))
+        return found;
+    return missingRecord();
+}
+
+//Same as IndexedDatabase::find(): records come from the tree in (value, key) order, so the key is binary searched
+//within the run of equal values
+Record* FrozenIndex::find(std::string_view key, int value) const {
+    auto first = records.begin() + lowerBound(value), last = records.begin() + upperBound(value);
+    auto it = std::lower_bound(first, last, key, [](const Record* r, std::string_view k) { return r->key < k; });
+    return it != last && (*it)->key == key ? *it : nullptr;
+}
 
+std::vector<Record*> FrozenIndex::rangeQuery(int start, int end) const {
+    std::vector<Record*> out;
+    rangeQuery(start, end, out);
     return out;
 }
 
-std::vector<Record*> AVLTree::rangeQuery(int start, int end) const {
-    return rangeQueryHelper(root, start, end);
+void FrozenIndex::rangeQuery(int start, int end, std::vector<Record*>& out) const {
+    if(start > end)
+        return;
+    int first = lowerBound(start), last = upperBound(end);
+    out.insert(out.end(), records.begin() + first, records.begin() + last); //contiguous, one copy
+}
+
+std::vector<Record*> FrozenIndex::findKNearestKeys(int key, int k) const {
+    return nearestHelper(key, k, LLONG_MAX);
+}
+
+std::vector<Record*> FrozenIndex::findKNearestKeysWithin(int key, int k, int radius) const {
+    if(radius < 0)
+        return {};
+    return nearestHelper(key, k, radius);
 }
 
-//Recursive helper function that lets public function access private root
-//basically copied from iotHelper() and modified to only work in given range
-std::vector<Record*> AVLTree::rangeQueryHelper(AVLNode* a, int start, int end) const {
+//Same two-cursor walk as AVLTree::nearestHelper(), over the sorted arrays
+std::vector<Record*> FrozenIndex::nearestHelper(int key, int k, long long radius) const {
     std::vector<Record*> out = {};
-    
-    if(!a)  //base case 1: a is nullptr
-        return out; //return empty vector
+    if(k <= 0)
+        return out;
+    int n = values.size();
+    out.reserve(k < n ? k : n);
+    int below = lowerBound(key) - 1, above = upperBound(key);
+    while(k > 0 && (below >= 0 || above < n)) {
+        long long belowDist = below >= 0 ? (long long)key - values[below] : LLONG_MAX;
+        long long aboveDist = above < n ? (long long)values[above] - key : LLONG_MAX;
+        if(aboveDist < belowDist) { //above is strictly closer
+            if(aboveDist > radius)
+                break;
+            out.push_back(records[above++]);
+        } else {
+            if(belowDist > radius)
+                break;
+            out.push_back(records[below--]);
+        }
+        k--;
+    }
+    std::reverse(out.begin(), out.end());   //same order as AVLTree::findKNearestKeys()
+    return out;
+}
 
-    //recursive case 2: a exists, then rangequery further down either, both, or neither path as necessary 
-    if(a->record->value > start)
-        out = rangeQueryHelper(a->left, start, end);    //first set output vector to returned left-side vector
-    
-    if(a->record->value >= start && a->record->value <= end)
-        out.push_back(a->record);   //second add a's record to output vector (if a's record falls within range)
+std::vector<Record*> FrozenIndex::inorderTraversal() const {
+    return records;
+}
 
-    if(a->record->value < end) {
-        std::vector<Record*> temp = rangeQueryHelper(a->right, start, end); //need temp as second vector to allow insert() to combine two vectors
-        out.insert(out.end(), temp.begin(), temp.end());    //third add returned right-side vector (temp) to output vector
+int FrozenIndex::countRecords() const {
+    return records.size();
+}
+
+//FNV-1a, cheap enough to checksum every log entry
+static uint32_t checksum(const char* data, size_t len) {
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 16777619u;
     }
+    return h;
+}
 
-    return out;
+//write() until everything is out or it fails
+static bool writeAll(int fd, const char* data, size_t len) {
+    while(len > 0) {
+        ssize_t w = ::write(fd, data, len);
+        if(w < 0)
+            return false;
+        data += w;
+        len -= w;
+    }
+    return true;
 }
 
-//Returns a vector with k elements, of the k nearest records to the value of 'key'
-std::vector<Record*> AVLTree::findKNearestKeys(int key, int k) const {
-    std::priority_queue<Record*,std::vector<Record*>, RecordPtrCmp1> below; //maxheap because RecordPtrCmp1 is greater than operator function pointer
-    std::priority_queue<Record*,std::vector<Record*>, RecordPtrCmp2> above; //minheap because RecordPtrCmp2 is less than operator function pointer
-    //tbh, heaps aren't really necessary and simple queue would work just as well
-    //since inorderTraversal() already gives a sorted vector of records.  If it didn't, though...
+//GENERATION entries carry the generation's bytes in the key's place
+static std::string generationBytes(uint64_t generation) {
+    return std::string(reinterpret_cast<const char*>(&generation), sizeof(generation));
+}
 
-    std::vector<Record*> temp = inorderTraversal(), out = {};   //initialize temp to all records in tree
-    
-    for (auto i : temp) {
-        if(i->value < key)
-            below.push(i);  //all records lower than key pushed into below
-        if(i->value > key)
-            above.push(i);  //all records higher than key pushed into above
+static bool decodeGeneration(std::string_view key, uint64_t& generation) {
+    if(key.size() != sizeof(generation))
+        return false;
+    std::memcpy(&generation, key.data(), sizeof(generation));
+    return true;
+}
+
+WriteAheadLog::WriteAheadLog() : fd(-1), pending(0), groupSize(1), commitFailed(false) {}
+
+WriteAheadLog::~WriteAheadLog() {
+    close();
+}
+
+bool WriteAheadLog::open(const std::string& path, size_t group, size_t validLength) {
+    close();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if(fd < 0)
+        return false;
+    if(::ftruncate(fd, validLength) != 0 || ::lseek(fd, validLength, SEEK_SET) < 0) {  //cut off a torn tail so new entries follow intact ones
+        close();
+        return false;
     }
-    
-    while(!below.empty() && !above.empty() && k>0) {    //while both below and above non-empty (and k not exhausted (== 0))
-        if( (above.top()->value - key) < (key - below.top()->value)) {  //if above's top is closer than below's top to key
-            out.push_back(above.top());
-            above.pop();
-        } else {
-            out.push_back(below.top());
-            below.pop();
+    groupSize = group ? group : 1;
+    return true;
+}
+
+void WriteAheadLog::close() {
+    if(fd >= 0) {
+        commit();
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool WriteAheadLog::isOpen() const {
+    return fd >= 0;
+}
+
+bool WriteAheadLog::append(Op op, std::string_view key, int value) {
+    uint32_t payloadLen = 1 + sizeof(int32_t) + key.size();
+    size_t at = buffer.size();
+    buffer.resize(at + 2 * sizeof(uint32_t) + payloadLen);
+    char* p = &buffer[at];
+    char* payload = p + 2 * sizeof(uint32_t);
+    int32_t v = value;
+    payload[0] = op;
+    std::memcpy(payload + 1, &v, sizeof(v));
+    std::memcpy(payload + 1 + sizeof(v), key.data(), key.size());
+    uint32_t sum = checksum(payload, payloadLen);
+    std::memcpy(p, &payloadLen, sizeof(payloadLen));
+    std::memcpy(p + sizeof(payloadLen), &sum, sizeof(sum));
+    return ++pending < groupSize || commit();   //group full, commit it
+}
+
+//A failed write or sync is cut back off the file, so the retry doesn't follow a torn group, and the group stays buffered
+bool WriteAheadLog::commit() {
+    if(fd < 0 || buffer.empty())
+        return fd >= 0;
+    off_t at = ::lseek(fd, 0, SEEK_CUR);
+    if(at < 0 || !writeAll(fd, buffer.data(), buffer.size()) || ::fdatasync(fd) != 0) {
+        if(at >= 0 && ::ftruncate(fd, at) == 0)
+            ::lseek(fd, at, SEEK_SET);
+        commitFailed = true;
+        return false;
+    }
+    buffer.clear();
+    pending = 0;
+    commitFailed = false;
+    return true;
+}
+
+bool WriteAheadLog::failed() const {
+    return commitFailed;
+}
+
+//The GENERATION entry is the new log's first, committed right away so the log's generation is durable before any change
+bool WriteAheadLog::truncate(uint64_t generation) {
+    buffer.clear();
+    pending = 0;
+    commitFailed = false;
+    if(fd < 0 || ::ftruncate(fd, 0) != 0 || ::lseek(fd, 0, SEEK_SET) != 0)
+        return false;
+    append(GENERATION, generationBytes(generation), 0);
+    return commit();
+}
+
+long long WriteAheadLog::replay(const std::string& path, const std::function<void(Op, std::string_view, int)>& apply) {
+    int in = ::open(path.c_str(), O_RDONLY);
+    if(in < 0)
+        return errno == ENOENT ? 0 : -1;
+    std::string data;
+    char chunk[1 << 16];
+    ssize_t r;
+    while((r = ::read(in, chunk, sizeof(chunk))) > 0)
+        data.append(chunk, r);
+    ::close(in);
+    if(r < 0)
+        return -1;
+
+    size_t pos = 0;
+    const size_t HEADER = 2 * sizeof(uint32_t);
+    while(data.size() - pos >= HEADER) {
+        uint32_t payloadLen, sum;
+        std::memcpy(&payloadLen, &data[pos], sizeof(payloadLen));
+        std::memcpy(&sum, &data[pos + sizeof(payloadLen)], sizeof(sum));
+        if(payloadLen < 1 + sizeof(int32_t) || data.size() - pos - HEADER < payloadLen)   //torn entry
+            break;
+        const char* payload = &data[pos + HEADER];
+        if(checksum(payload, payloadLen) != sum)    //corrupt entry
+            break;
+        int32_t v;
+        std::memcpy(&v, payload + 1, sizeof(v));
+        apply(static_cast<Op>(payload[0]), std::string_view(payload + 1 + sizeof(v), payloadLen - 1 - sizeof(v)), v);
+        pos += HEADER + payloadLen;
+    }
+    return pos;
+}
+
+//On-disk snapshot header, followed by the value column, the key offsets and the string heap
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t count;
+    uint64_t heapSize;
+    uint64_t generation;    //version 2 on, version 1 headers end before it
+};
+static const char SNAPSHOT_MAGIC[8] = {'A', 'V', 'L', 'S', 'N', 'A', 'P', '2'};
+static const char SNAPSHOT_MAGIC_V1[8] = {'A', 'V', 'L', 'S', 'N', 'A', 'P', '1'};
+static const size_t SNAPSHOT_HEADER_V1 = offsetof(SnapshotHeader, generation);
+
+MappedSnapshot::MappedSnapshot() : base(nullptr), length(0), gen(0), keyOrdered(false), n(0), values(nullptr), offsets(nullptr), heap(nullptr) {}
+
+MappedSnapshot::~MappedSnapshot() {
+    close();
+}
+
+//Maps the file and checks the header against the file size, then that the key offsets climb from 0 to the heap size,
+//so every key() stays inside the heap.  Values and keys themselves are only read on use, so their pages fault in then
+bool MappedSnapshot::open(const std::string& path) {
+    close();
+    int in = ::open(path.c_str(), O_RDONLY);
+    if(in < 0)
+        return false;
+    struct stat st;
+    if(::fstat(in, &st) != 0 || st.st_size < (off_t)SNAPSHOT_HEADER_V1) {
+        ::close(in);
+        return false;
+    }
+    void* map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, in, 0);
+    ::close(in);    //the mapping keeps the file alive
+    if(map == MAP_FAILED)
+        return false;
+    base = map;
+    length = st.st_size;
+
+    const SnapshotHeader* header = static_cast<const SnapshotHeader*>(map);
+    const char* bytes = static_cast<const char*>(map);
+    size_t headerSize;
+    if(std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 && length >= sizeof(SnapshotHeader)) {
+        headerSize = sizeof(SnapshotHeader);
+        gen = header->generation;
+        keyOrdered = true;
+    } else if(std::memcmp(header->magic, SNAPSHOT_MAGIC_V1, sizeof(SNAPSHOT_MAGIC_V1)) == 0) {
+        headerSize = SNAPSHOT_HEADER_V1;
+        gen = 0;
+        keyOrdered = false;
+    } else {
+        close();
+        return false;
+    }
+    uint64_t count = header->count, heapSize = header->heapSize;
+    if(count > length / (sizeof(int32_t) + sizeof(uint32_t)) || heapSize > length ||  //also keeps the sum below from overflowing
+       headerSize + count * sizeof(int32_t) + (count + 1) * sizeof(uint32_t) + heapSize != length) {
+        close();
+        return false;
+    }
+    n = count;
+    values = reinterpret_cast<const int32_t*>(bytes + headerSize);
+    offsets = reinterpret_cast<const uint32_t*>(bytes + headerSize + n * sizeof(int32_t));
+    heap = bytes + headerSize + n * sizeof(int32_t) + (n + 1) * sizeof(uint32_t);
+    bool ok = offsets[0] == 0 && offsets[n] == heapSize;
+    for(size_t i = 1; ok && i <= n; i++)
+        ok = offsets[i] >= offsets[i - 1];  //with offsets[n] == heapSize, none can be past the heap either
+    if(!ok) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedSnapshot::close() {
+    if(base)
+        ::munmap(base, length);
+    base = nullptr;
+    length = n = 0;
+    gen = 0;
+}
+
+uint64_t MappedSnapshot::generation() const {
+    return gen;
+}
+
+size_t MappedSnapshot::count() const {
+    return n;
+}
+
+int MappedSnapshot::value(size_t i) const {
+    return values[i];
+}
+
+std::string_view MappedSnapshot::key(size_t i) const {
+    return std::string_view(heap + offsets[i], offsets[i + 1] - offsets[i]);
+}
+
+size_t MappedSnapshot::lowerBound(int value) const {
+    return std::lower_bound(values, values + n, value) - values;
+}
+
+//Version 2 files hold each run of equal values in key order, so the key is binary searched; version 1 runs are scanned
+bool MappedSnapshot::contains(std::string_view k, int value) const {
+    size_t i = lowerBound(value);
+    if(keyOrdered) {
+        size_t count = std::upper_bound(values + i, values + n, value) - (values + i);
+        while(count > 0) {
+            size_t half = count / 2;
+            if(key(i + half) < k) {
+                i += half + 1;
+                count -= half + 1;
+            } else
+                count = half;
         }
-        k--;    //remember to count only k records
+        return i < n && values[i] == value && key(i) == k;
     }
-    while(!below.empty() && k>0) {  //one of above/below is empty, thus fill from the non-empty one until k==0
-        out.push_back(below.top());
-        below.pop();
-        k--;
+    for(; i < n && values[i] == value; i++) {
+        if(key(i) == k)
+            return true;
     }
-    while(!above.empty() && k>0) {  //one of above/below is empty, thus fill from the non-empty one until k==0
-        out.push_back(above.top());
-        above.pop();
-        k--;
+    return false;
+}
+
+//Writes sorted records to path + ".tmp", syncs it, then renames it over path so readers never see a partial file
+bool MappedSnapshot::write(const std::string& path, const std::vector<Record*>& sorted, uint64_t generation) {
+    SnapshotHeader header;
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.count = sorted.size();
+    header.heapSize = 0;
+    header.generation = generation;
+    std::vector<int32_t> valueColumn;
+    std::vector<uint32_t> offsetColumn;
+    valueColumn.reserve(sorted.size());
+    offsetColumn.reserve(sorted.size() + 1);
+    for(auto r : sorted) {
+        if(header.heapSize + r->key.size() > UINT32_MAX)    //offsets are 32 bit
+            return false;
+        valueColumn.push_back(r->value);
+        offsetColumn.push_back(header.heapSize);
+        header.heapSize += r->key.size();
     }
+    offsetColumn.push_back(header.heapSize);
 
-    std::reverse(out.begin(), out.end());   //db_driver wants vector of records in reverse order of pushed order
-    return out;
+    std::string tmp = path + ".tmp";
+    int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0)
+        return false;
+    bool ok = writeAll(out, reinterpret_cast<const char*>(&header), sizeof(header))
+           && writeAll(out, reinterpret_cast<const char*>(valueColumn.data()), valueColumn.size() * sizeof(int32_t))
+           && writeAll(out, reinterpret_cast<const char*>(offsetColumn.data()), offsetColumn.size() * sizeof(uint32_t));
+    std::string heapChunk;  //keys go out in ~1MB chunks rather than one write per key
+    for(size_t i = 0; ok && i < sorted.size(); i++) {
+        heapChunk += sorted[i]->key;
+        if(heapChunk.size() >= (1 << 20) || i + 1 == sorted.size()) {
+            ok = writeAll(out, heapChunk.data(), heapChunk.size());
+            heapChunk.clear();
+        }
+    }
+    ok = ok && ::fsync(out) == 0;
+    ::close(out);
+    if(!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+IndexedDatabase::IndexedDatabase() : keyIndexed(false), logGeneration(0) {}
+
+IndexedDatabase::~IndexedDatabase() {
+    log.close();
+    for(auto r : ownedRecords)
+        delete r;
+}
+
+//Creates a record the database owns, for records that come from disk or are handed over by value
+Record* IndexedDatabase::adopt(Record&& record) {
+    Record* r = new Record(std::move(record));
+    ownedRecords.insert(r);
+    return r;
+}
+
+Record* IndexedDatabase::adopt(std::string_view key, int value) {
+    return adopt(Record(std::string(key), value));
+}
+
+//Frees a record that just left the tree if the database owns it.  In persistent mode snapshots may still be reading
+//it, so it is retired with the tree's nodes and freed once none can
+void IndexedDatabase::release(Record* removed) {
+    if(removed && ownedRecords.erase(removed))
+        index.retire([removed] { delete removed; });    //call on db's tree
 }
 
 void IndexedDatabase::insert(Record* record) {
-    index.insert(record);   //call insert on db's tree
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::INSERT]));
+    if(log.isOpen())
+        log.append(WriteAheadLog::INSERT, record->key, record->value);
+    index.insert(record->value, record);    //call insert on db's tree
+    if(keyIndexed)
+        keys.insert(record);
     //std::cout << countRecords() << " ";  //DEBUG
 }
 
+Record* IndexedDatabase::insert(Record&& record) {
+    Record* r = adopt(std::move(record));
+    insert(r);
+    return r;
+}
+
+Record* IndexedDatabase::emplace(std::string key, int value) {
+    return insert(Record(std::move(key), value));
+}
+
+//Pairs each record with its value, the form the tree's bulk operations take
+static std::vector<RecordTree::entry_type> toEntries(const std::vector<Record*>& records) {
+    std::vector<RecordTree::entry_type> entries;
+    entries.reserve(records.size());
+    for(auto r : records)
+        entries.emplace_back(r->value, r);
+    return entries;
+}
+
+//Tree order for records: by value, then by key like RecordKeyOrder
+static bool recordBefore(const Record* a, const Record* b) {
+    return a->value < b->value || (a->value == b->value && a->key < b->key);
+}
+
+//Puts records in tree order.  Input presorted by value is only checked, since records sharing a value usually come in
+//key order too, and gets the full (stable) sort if they don't
+static void sortRecords(std::vector<Record*>& records, bool presorted) {
+    if(!presorted || !std::is_sorted(records.begin(), records.end(), recordBefore))
+        std::stable_sort(records.begin(), records.end(), recordBefore);
+}
+
+//Sorts records by (value, key) unless presorted by value, then builds a perfectly balanced tree in linear time.
+//Records already in the database are kept
+void IndexedDatabase::bulkLoad(std::vector<Record*> records, bool presorted) {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::BULK_LOAD]));
+    if(log.isOpen()) {
+        for(auto r : records)
+            log.append(WriteAheadLog::INSERT, r->key, r->value);
+    }
+    sortRecords(records, presorted);
+    if(index.count() == 0)
+        index.buildSorted(toEntries(records));
+    else
+        index.mergeSorted(toEntries(records));
+    if(keyIndexed) {
+        for(auto r : records)
+            keys.insert(r);
+    }
+}
+
+//Like bulkLoad() but for adding a batch to a populated database: small batches are inserted one by one, big ones merged
+void IndexedDatabase::insertBatch(std::vector<Record*> records, bool presorted) {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::BULK_LOAD]));
+    if(log.isOpen()) {
+        for(auto r : records)
+            log.append(WriteAheadLog::INSERT, r->key, r->value);
+    }
+    sortRecords(records, presorted);
+    index.insertBatch(toEntries(records));
+    if(keyIndexed) {
+        for(auto r : records)
+            keys.insert(r);
+    }
+}
+
+//Turns a key into a tree probe.  With interned keys this resolves the id once, and a key that was never interned can't
+//be in any database, so the lookup ends without touching the tree
+static bool keyProbe(std::string_view key, RecordKeyMatch& probe) {
+#ifdef AVL_INTERNED_KEYS
+    return InternedKey::lookup(key, probe.key);
+#else
+    probe.key = key;
+    return true;
+#endif
+}
+
+Record* IndexedDatabase::find(std::string_view key, int value) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::SEARCH]));
+    RecordKeyMatch probe{};
+    if(!keyProbe(key, probe))
+        return nullptr;
+    Record* const* found = index.find(value, probe);    //call search on db's tree
+    return found ? *found : nullptr;
+}
+
+#ifdef AVL_INTERNED_KEYS
+Record* IndexedDatabase::find(const InternedKey& key, int value) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::SEARCH]));
+    Record* const* found = index.find(value, RecordKeyMatch{key});  //call search on db's tree
+    return found ? *found : nullptr;
+}
+
+void IndexedDatabase::deleteRecord(const InternedKey& key, int value) {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::DELETE]));
+    if(log.isOpen())
+        log.append(WriteAheadLog::DELETE, key, value);
+    Record* removed = index.erase(value, RecordKeyMatch{key}).value_or(nullptr);  //call delete on db's tree
+    if(removed && keyIndexed)
+        keys.erase(removed);
+    release(removed);
+}
+#endif
+
 Record* IndexedDatabase::search(const std::string& key, int value) const {
-    return index.search(key, value);    //call search on db's tree
+    if(Record* found = find(key, value))
+        return found;
+    return missingRecord();
 }
 
 void IndexedDatabase::deleteRecord(const std::string& key, int value) {
-    index.deleteNode(key, value);   //call delete on db's tree
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::DELETE]));
+    if(log.isOpen())
+        log.append(WriteAheadLog::DELETE, key, value);
+    RecordKeyMatch probe{};
+    Record* removed = keyProbe(key, probe) ? index.erase(value, probe).value_or(nullptr) : nullptr;   //call delete on db's tree
+    if(removed && keyIndexed)
+        keys.erase(removed);
+    release(removed);
     //std::cout << countRecords() << " ";  //DEBUG
 }
 
 std::vector<Record*> IndexedDatabase::rangeQuery(int start, int end) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::RANGE_QUERY]));
     return index.rangeQuery(start, end);    //call on db's tree
 }
 
+void IndexedDatabase::rangeQuery(int start, int end, std::vector<Record*>& out) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::RANGE_QUERY]));
+    index.rangeQuery(start, end, out);  //call on db's tree
+}
+
 std::vector<Record*> IndexedDatabase::findKNearestKeys(int key, int k) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::NEAREST]));
     return index.findKNearestKeys(key, k);  //call on db's tree
 }
 
+std::vector<Record*> IndexedDatabase::findKNearestKeysWithin(int key, int k, int radius) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::NEAREST]));
+    if(radius < 0)
+        return {};
+    return index.findKNearestKeysWithin(key, k, radius);   //call on db's tree
+}
+
+//Each probe descends by (value, key) like find(), so long runs of one value cost nothing extra
+std::vector<Record*> IndexedDatabase::searchBatch(const std::vector<std::pair<std::string, int>>& probes) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::SEARCH]));
+    std::vector<int> values, slots;
+    std::vector<RecordKeyMatch> matches;
+    values.reserve(probes.size());
+    matches.reserve(probes.size());
+    slots.reserve(probes.size());
+    for(size_t i = 0; i < probes.size(); i++) {
+        RecordKeyMatch probe{};
+        if(!keyProbe(probes[i].first, probe))   //a key that was never interned can't be found
+            continue;
+        values.push_back(probes[i].second);
+        matches.push_back(std::move(probe));    //interned keys hold a reference, moving skips a count round trip
+        slots.push_back(i);
+    }
+    std::vector<Record*> found(probes.size(), nullptr);
+    index.findBatch(values, matches, [&](int i, Record* r) { found[slots[i]] = r; });   //call on db's tree
+    return found;
+}
+
+std::vector<std::vector<Record*>> IndexedDatabase::rangeQueryBatch(const std::vector<std::pair<int, int>>& ranges) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::RANGE_QUERY]));
+    std::vector<std::vector<Record*>> out(ranges.size());
+    index.rangeQueryBatch(ranges, [&out](int i, Record* r) { out[i].push_back(r); });   //call on db's tree
+    return out;
+}
+
 std::vector<Record*> IndexedDatabase::inorderTraversal() const {
     return index.inorderTraversal();    //call on db's tree
 }
     
 
+//Turns on path-copying mode so other threads can read (through snapshot() or the read methods) while one writes
+void IndexedDatabase::setPersistent(bool on) {
+    index.setPersistent(on);    //call on db's tree
+}
+
+IndexedDatabase::Snapshot IndexedDatabase::snapshot() const {
+    return index.snapshot();    //call on db's tree
+}
+
 void IndexedDatabase::clearDatabase() {
-    index.deleteAll();  //call on db's tree
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::CLEAR]));
+    if(log.isOpen())
+        log.append(WriteAheadLog::CLEAR, "", 0);
+    clearContents();
+}
+
+//Log payload of a DELETE_RANGE entry: the range end's bytes, in the key's place
+static std::string_view rangeEndBytes(const int32_t& end) {
+    return std::string_view(reinterpret_cast<const char*>(&end), sizeof(end));
 }
 
-//should add size variable to IndexedDatabase and update variable on delete/insert for O(1) instead of current O(n)
+//Cuts the whole range out of the tree in O(log n), then drops each removed record from the key index and frees it if owned
+int IndexedDatabase::deleteRange(int start, int end) {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::DELETE]));
+    if(log.isOpen())
+        log.append(WriteAheadLog::DELETE_RANGE, rangeEndBytes(end), start);
+    return index.eraseRange(start, end, [this](Record* removed) {   //call on db's tree
+        if(keyIndexed)
+            keys.erase(removed);
+        release(removed);
+    });
+}
+
+std::unique_ptr<IndexedDatabase> IndexedDatabase::extractRange(int start, int end) {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::DELETE]));
+    if(log.isOpen())
+        log.append(WriteAheadLog::DELETE_RANGE, rangeEndBytes(end), start);
+    std::unique_ptr<IndexedDatabase> out(new IndexedDatabase());
+    out->setPersistent(index.isPersistent());
+    out->setKeyIndex(keyIndexed);
+    index.extractRange(start, end, out->index); //call on db's tree
+    if(keyIndexed || !ownedRecords.empty()) {   //key index entries and ownership follow the records
+        for(Record* r : *out) {
+            if(keyIndexed) {
+                keys.erase(r);
+                out->keys.insert(r);
+            }
+            out->ownedRecords.insert(ownedRecords.extract(r));  //empty handle, so no-op, for records the caller owns
+        }
+    }
+    return out;
+}
+
+//other's tree nodes and owned records are taken over, not copied; only logging and the key index visit each record
+void IndexedDatabase::merge(IndexedDatabase& other) {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::BULK_LOAD]));
+    if(&other == this)
+        return;
+    if(log.isOpen() || keyIndexed) {
+        for(Record* r : other) {
+            if(log.isOpen())
+                log.append(WriteAheadLog::INSERT, r->key, r->value);
+            if(keyIndexed)
+                keys.insert(r);
+        }
+    }
+    if(other.log.isOpen())
+        other.log.append(WriteAheadLog::CLEAR, "", 0);
+    other.keys.clear();
+    ownedRecords.merge(other.ownedRecords);
+    index.join(other.index);    //call on db's tree
+}
+
+void IndexedDatabase::clearContents() {
+    index.deleteAll();  //call on db's tree, releases the node slabs wholesale
+    keys.clear();
+    if(!ownedRecords.empty()) { //retired together, snapshots may still hold them
+        std::vector<Record*> owned(ownedRecords.begin(), ownedRecords.end());
+        ownedRecords.clear();
+        index.retire([owned] {  //call on db's tree
+            for(auto r : owned)
+                delete r;
+        });
+    }
+}
+
+//O(1), root's subtree size is the record count
 int IndexedDatabase::countRecords() const {
-    return index.inorderTraversal().size(); //call on db's tree, using size() method of returned vector
+    return index.count();   //call on db's tree
+}
+
+int IndexedDatabase::rank(int value) const {
+    return index.rank(value);   //call on db's tree
+}
+
+Record* IndexedDatabase::select(int i) const {
+    Record* const* found = index.select(i); //call on db's tree
+    return found ? *found : nullptr;
+}
+
+int IndexedDatabase::countInRange(int start, int end) const {
+    return index.countInRange(start, end);  //call on db's tree
+}
+
+int IndexedDatabase::countEqual(int value) const {
+    return index.countInRange(value, value);    //call on db's tree
 }
 
+RangeAggregate IndexedDatabase::aggregateRange(int start, int end) const {
+    RecordTree::aggregate_type found = index.aggregateRange(start, end);    //call on db's tree
+    RangeAggregate out;
+    if(found.count > 0) {
+        out.count = found.count;
+        out.sum = found.summary.sum;
+        out.min = found.summary.min;
+        out.max = found.summary.max;
+    }
+    return out;
+}
+
+double RangeAggregate::average() const {
+    return count ? static_cast<double>(sum) / count : 0;
+}
+
+//Nearest-rank percentile over value, p in [0, 100] (p50 = median, p99, ...).  Returns nullptr on an empty database
+Record* IndexedDatabase::percentile(double p) const {
+    int n = index.count();
+    if(n == 0)
+        return nullptr;
+    int r = static_cast<int>(std::ceil(p / 100.0 * n));    //1-based nearest rank
+    if(r < 1)
+        r = 1;
+    if(r > n)
+        r = n;
+    return select(r - 1);
+}
+
+IndexedDatabase::iterator IndexedDatabase::begin() const {
+    return index.begin();   //call on db's tree
+}
+
+IndexedDatabase::iterator IndexedDatabase::end() const {
+    return index.end(); //call on db's tree
+}
+
+IndexedDatabase::iterator IndexedDatabase::lower_bound(int value) const {
+    return index.lower_bound(value);    //call on db's tree
+}
+
+IndexedDatabase::iterator IndexedDatabase::upper_bound(int value) const {
+    return index.upper_bound(value);    //call on db's tree
+}
+
+std::pair<IndexedDatabase::iterator, IndexedDatabase::iterator> IndexedDatabase::equalRange(int value) const {
+    return {index.lower_bound(value), index.upper_bound(value)};    //call on db's tree
+}
+
+//Snapshot of the current records in a read-optimized layout.  Later changes to the database don't show up in it
+FrozenIndex IndexedDatabase::freeze() const {
+    return FrozenIndex(index.inorderTraversal());
+}
+
+//Turning the key index on builds it from the current records in O(n); turning it off drops it
+void IndexedDatabase::setKeyIndex(bool on) {
+    keys.clear();
+    keyIndexed = on;
+    if(on) {
+        for(auto r : index.inorderTraversal())
+            keys.insert(r);
+    }
+}
+
+Record* IndexedDatabase::findByKey(std::string_view key) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::SEARCH]));
+    if(!keyIndexed) {   //no index, fall back to a scan
+        Record* out = nullptr;
+        index.rangeQuery(INT_MIN, INT_MAX, [&](Record* r) {
+            if(r->key != key)
+                return true;
+            out = r;
+            return false;
+        });
+        return out;
+    }
+    return keys.find(key);
+}
+
+bool IndexedDatabase::deleteByKey(std::string_view key) {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::DELETE]));
+    Record* r = findByKey(key);
+    if(!r)
+        return false;
+    if(log.isOpen())
+        log.append(WriteAheadLog::DELETE, r->key, r->value);
+    Record* removed = index.erase(r->value, RecordKeyMatch{r->key}).value_or(nullptr);
+    if(removed && keyIndexed)
+        keys.erase(removed);    //erase what the tree removed, which may be a different record with the same key and value
+    release(removed);
+    return removed != nullptr;
+}
+
+bool IndexedDatabase::writeSnapshot(const std::string& path) const {
+    return MappedSnapshot::write(path, index.inorderTraversal());
+}
+
+//The snapshot is already sorted, so the tree is built directly in O(n) without rebalancing.  Only snapshots written
+//before records sharing a value were kept in key order need sorting
+bool IndexedDatabase::loadSnapshot(const std::string& path) {
+    MappedSnapshot snap;
+    if(!snap.open(path))
+        return false;
+    clearContents();    //not logged, the snapshot itself is the durable copy
+    logGeneration = snap.generation();
+    std::vector<Record*> records;
+    records.reserve(snap.count());
+    for(size_t i = 0; i < snap.count(); i++)
+        records.push_back(adopt(snap.key(i), snap.value(i)));
+    sortRecords(records, true);
+    index.buildSorted(toEntries(records));
+    if(keyIndexed) {
+        for(auto r : records)
+            keys.insert(r);
+    }
+    return true;
+}
+
+bool IndexedDatabase::openLog(const std::string& path, size_t groupSize) {
+    uint64_t generation = 0;    //a log without a GENERATION entry is generation 0
+    long long valid = WriteAheadLog::replay(path, [&generation](WriteAheadLog::Op op, std::string_view key, int) {
+        if(op == WriteAheadLog::GENERATION)
+            decodeGeneration(key, generation);
+    }); //find the intact prefix and the log's generation
+    if(valid < 0 || !log.open(path, groupSize, valid))
+        return false;
+    if(valid == 0)  //new log, it starts at this database's generation
+        return log.truncate(logGeneration);
+    logGeneration = generation;
+    return true;
+}
+
+bool IndexedDatabase::syncLog() {
+    return log.commit();
+}
+
+bool IndexedDatabase::logFailed() const {
+    return log.failed();
+}
+
+void IndexedDatabase::closeLog() {
+    log.close();
+}
+
+//Startup: load the last snapshot (if any), replay the log written since, then keep appending to that log.
+//Cost is the snapshot size plus the log tail, not the whole history of operations.  A log older than the snapshot's
+//generation was already checkpointed into it (the crash came before the log was started over), so it is skipped and
+//started over now
+bool IndexedDatabase::recover(const std::string& snapshotPath, const std::string& logPath, size_t groupSize) {
+    log.close();
+    struct stat st;
+    if(::stat(snapshotPath.c_str(), &st) != 0) {
+        if(errno != ENOENT)
+            return false;
+        clearContents();    //no snapshot yet, the log holds everything
+        logGeneration = 0;
+    } else if(!loadSnapshot(snapshotPath))
+        return false;   //unreadable or corrupt, going on would silently drop everything up to its checkpoint
+    uint64_t covered = logGeneration;
+    bool skipping = covered > 0;    //entries before any GENERATION entry are generation 0
+    long long valid = WriteAheadLog::replay(logPath, [this, covered, &skipping](WriteAheadLog::Op op, std::string_view key, int value) {
+        uint64_t generation;
+        if(op == WriteAheadLog::GENERATION && decodeGeneration(key, generation)) {
+            skipping = generation < covered;
+            if(!skipping)
+                logGeneration = generation;
+        } else if(skipping)
+            return;
+        else if(op == WriteAheadLog::INSERT)
+            insert(adopt(key, value));
+        else if(op == WriteAheadLog::DELETE)
+            deleteRecord(std::string(key), value);
+        else if(op == WriteAheadLog::CLEAR)
+            clearDatabase();
+        else if(op == WriteAheadLog::DELETE_RANGE && key.size() == sizeof(int32_t)) {
+            int32_t end;
+            std::memcpy(&end, key.data(), sizeof(end));
+            deleteRange(value, end);
+        }
+    });
+    if(valid < 0)
+        return false;
+    bool restart = valid == 0 || skipping;  //empty, or covered by the snapshot: start it over at the snapshot's generation
+    if(!log.open(logPath, groupSize, restart ? 0 : valid))
+        return false;
+    return !restart || log.truncate(logGeneration);
+}
+
+//The snapshot is stamped with the next generation before the log is started over at it, so a crash in between leaves
+//an old-generation log that recover() knows the snapshot already covers
+bool IndexedDatabase::checkpoint(const std::string& snapshotPath) {
+    uint64_t next = logGeneration + 1;
+    if(!MappedSnapshot::write(snapshotPath, index.inorderTraversal(), next))
+        return false;
+    logGeneration = next;
+    return !log.isOpen() || log.truncate(next); //drops buffered entries too, the snapshot has them
+}
+
+DatabaseStats IndexedDatabase::stats() const {
+    DatabaseStats out;
+    out.tree = index.stats();
+#ifdef AVL_STATS
+    out.enabled = true;
+    for(int op = 0; op < DatabaseStats::OP_COUNT; op++)
+        latency[op].copyTo(out.latency[op]);
+#endif
+    return out;
+}
+
+bool IndexedDatabase::checkInvariants() const {
+    return index.checkInvariants(); //call on db's tree
+}
+
+void IndexedDatabase::resetStats() {
+    index.resetStats();
+#ifdef AVL_STATS
+    for(auto& recorder : latency)
+        recorder.reset();
+#endif
+}
+
+#ifdef AVL_STATS
+LatencyRecorder::LatencyRecorder() {
+    reset();
+}
+
+void LatencyRecorder::record(unsigned long long ns) {
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;    //floor(log2(ns))
+    if(bucket >= LatencyHistogram::BUCKETS)
+        bucket = LatencyHistogram::BUCKETS - 1;
+    avlStatBump(buckets[bucket]);
+}
+
+void LatencyRecorder::copyTo(LatencyHistogram& out) const {
+    for(int i = 0; i < LatencyHistogram::BUCKETS; i++)
+        out.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+}
+
+void LatencyRecorder::reset() {
+    for(auto& b : buckets)
+        b.store(0);
+}
+#endif
+
+unsigned long long LatencyHistogram::count() const {
+    unsigned long long total = 0;
+    for(auto b : buckets)
+        total += b;
+    return total;
+}
+
+unsigned long long LatencyHistogram::percentile(double p) const {
+    unsigned long long total = count();
+    if(total == 0)
+        return 0;
+    unsigned long long rank = static_cast<unsigned long long>(std::ceil(p / 100.0 * total));    //nearest rank, like IndexedDatabase::percentile()
+    if(rank < 1)
+        rank = 1;
+    unsigned long long seen = 0;
+    for(int i = 0; i < BUCKETS; i++) {
+        seen += buckets[i];
+        if(seen >= rank)
+            return 2ULL << i;   //bucket i ends at 2^(i+1)
+    }
+    return 2ULL << (BUCKETS - 1);
+}
+
+const char* DatabaseStats::opName(int op) {
+    static const char* names[OP_COUNT] = {"insert", "search", "delete", "range_query", "nearest", "bulk_load", "clear"};
+    return op >= 0 && op < OP_COUNT ? names[op] : "unknown";
+}
+
+std::string DatabaseStats::toText() const {
+    std::ostringstream out;
+    out << "stats " << (enabled ? "enabled" : "disabled (build with -DAVL_STATS)") << "\n"
+        << "height " << tree.height << "\n"
+        << "size " << tree.size << "\n";
+    if(enabled) {
+        out << "rotations_left " << tree.rotationsLeft << "\n"
+            << "rotations_right " << tree.rotationsRight << "\n"
+            << "searches " << tree.searches << " (" << tree.searchNodesVisited << " nodes visited)\n"
+            << "range_queries " << tree.rangeQueries << " (" << tree.rangeNodesVisited << " nodes visited)\n"
+            << "node_allocations " << tree.nodeAllocations << "\n"
+            << "node_releases " << tree.nodeReleases << "\n"
+            << "slab_allocations " << tree.slabAllocations << "\n";
+        for(int op = 0; op < OP_COUNT; op++) {
+            out << "latency " << opName(op) << ": count " << latency[op].count()
+                << ", p50 <= " << latency[op].percentile(50) << "ns"
+                << ", p99 <= " << latency[op].percentile(99) << "ns"
+                << ", max <= " << latency[op].percentile(100) << "ns\n";
+        }
+    }
+    return out.str();
+}
+
+std::string DatabaseStats::toJson() const {
+    std::ostringstream out;
+    out << "{\"enabled\":" << (enabled ? "true" : "false")
+        << ",\"height\":" << tree.height
+        << ",\"size\":" << tree.size
+        << ",\"rotations_left\":" << tree.rotationsLeft
+        << ",\"rotations_right\":" << tree.rotationsRight
+        << ",\"searches\":" << tree.searches
+        << ",\"search_nodes_visited\":" << tree.searchNodesVisited
+        << ",\"range_queries\":" << tree.rangeQueries
+        << ",\"range_nodes_visited\":" << tree.rangeNodesVisited
+        << ",\"node_allocations\":" << tree.nodeAllocations
+        << ",\"node_releases\":" << tree.nodeReleases
+        << ",\"slab_allocations\":" << tree.slabAllocations
+        << ",\"latency\":{";
+    for(int op = 0; op < OP_COUNT; op++) {
+        out << (op ? "," : "") << "\"" << opName(op) << "\":{\"count\":" << latency[op].count()
+            << ",\"p50_ns\":" << latency[op].percentile(50)
+            << ",\"p99_ns\":" << latency[op].percentile(99)
+            << ",\"max_ns\":" << latency[op].percentile(100)
+            << ",\"buckets\":[";
+        for(int i = 0; i < LatencyHistogram::BUCKETS; i++)
+            out << (i ? "," : "") << latency[op].buckets[i];
+        out << "]}";
+    }
+    out << "}}";
+    return out.str();
+}
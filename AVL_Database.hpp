@@ -1,87 +1,470 @@
 #ifndef AVL_DATABASE_HPP
 #define AVL_DATABASE_HPP
 
+#include "AVL_Tree.hpp"
 #include <string>
 #include <vector>
-//#include <queue>
+#include <atomic>   //for LatencyRecorder buckets
+#include <string_view>  //for allocation-free lookups in KeyIndex
+#include <cstdint>  //for fixed-width fields in the log and snapshot formats
+#include <functional>   //for the WriteAheadLog::replay() callback
+#include <unordered_set>    //for records owned by IndexedDatabase
+#include <chrono>   //for operation latencies under AVL_STATS
+#include <utility>  //for the (key, value) and (start, end) probes of the batch reads
+#include <memory>   //for extractRange()'s database, KeyArena's chunks
+#ifdef AVL_INTERNED_KEYS
+#include <shared_mutex> //for KeyArena's table lock
+#include <unordered_map>    //for KeyArena's free lists
+#endif
+
+//Latency histogram with power-of-two buckets: bucket i counts operations that took [2^i, 2^(i+1)) ns
+struct LatencyHistogram {
+    static const int BUCKETS = 40;  //up to ~18 minutes
+    unsigned long long buckets[BUCKETS] = {};
+
+    unsigned long long count() const;
+    unsigned long long percentile(double p) const;  //upper bound (ns) of the bucket holding the p-th percentile
+};
+
+//Snapshot returned by IndexedDatabase::stats()
+struct DatabaseStats {
+    enum Op { INSERT, SEARCH, DELETE, RANGE_QUERY, NEAREST, BULK_LOAD, CLEAR, OP_COUNT };
+    static const char* opName(int op);
+
+    bool enabled = false;   //built with AVL_STATS
+    AVLTreeStats tree;
+    LatencyHistogram latency[OP_COUNT];
+
+    std::string toText() const;
+    std::string toJson() const;
+};
+
+#ifdef AVL_STATS
+//Live counterpart of LatencyHistogram, safe to record into from several threads
+class LatencyRecorder {
+private:
+    std::atomic<unsigned long long> buckets[LatencyHistogram::BUCKETS];
+
+public:
+    LatencyRecorder();
+    void record(unsigned long long ns);
+    void copyTo(LatencyHistogram& out) const;
+    void reset();
+};
+#endif
+
+#ifdef AVL_INTERNED_KEYS
+//Process-wide interning table behind InternedKey: every distinct key is stored once, after a reference count and its
+//length, in 4MB chunks, and its 32-bit id is where it sits (chunk index and offset), so there is no per-key entry
+//besides the hash slot.  Chunks never move and are never freed, so resolving an id takes no lock.  Interning a key
+//that is already there takes the table lock shared; only new keys and the last InternedKey of a key going away take
+//it exclusively, and the space of a released key is reused by the next key of the same size.  Up to 4GB of key bytes
+class KeyArena {
+public:
+    static KeyArena& instance();
+
+    uint32_t intern(std::string_view key);  //id of key, added if new, with a reference taken
+    bool lookup(std::string_view key, uint32_t& id) const;  //same, but only if key is interned already
+    void acquire(uint32_t id);  //another reference to a held id
+    void release(uint32_t id);  //drops a reference, forgetting the key with its last one
+    const char* data(uint32_t id) const;
+    size_t count() const;   //distinct keys interned
+    size_t bytes() const;   //chunk bytes in use by them, headers included
+
+private:
+    static const int CHUNK_BITS = 22;
+    static const size_t CHUNK_BYTES = size_t(1) << CHUNK_BITS;
+    static const size_t MAX_CHUNKS = size_t(1) << (32 - CHUNK_BITS);
+    static const uint32_t NO_ID = UINT32_MAX;   //never a real id, a header can't start that late in a chunk
+    static const uint32_t RELEASED = UINT32_MAX;    //reference count of an entry that is on the free list
+
+    struct Slot {
+        uint32_t hash;  //low bits of the key's hash, also its home slot
+        uint32_t id;    //NO_ID = empty slot
+    };
+
+    std::atomic<char*> chunkTable[MAX_CHUNKS];  //published once written to, so data() needs no lock
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunkUsed;   //bytes handed out from the newest chunk
+    size_t chunkSize;   //size of the newest chunk, bigger than CHUNK_BYTES only for a huge key
+    size_t usedBytes;
+    std::unordered_map<size_t, std::vector<uint32_t>> freeIds;  //entry size -> ids of released entries that size
+    std::vector<Slot> slots;    //open addressing with linear probing, at most 3/4 full to keep the slots small
+    uint32_t used;
+    mutable std::shared_mutex lock;
+
+    KeyArena();
+    std::atomic<uint32_t>& refs(uint32_t id) const;
+    static size_t entrySize(size_t length);
+    size_t find(std::string_view key, uint32_t hash) const; //slot holding key, or the empty slot it would go in
+    void erase(size_t i);
+    void grow();
+    uint32_t allocate(std::string_view key);
+};
+
+//Record key under AVL_INTERNED_KEYS: the key's KeyArena id and its cached length, 8 bytes in place of a std::string
+//and its heap buffer.  Each one holds a reference on its id, so a key leaves the arena with its last record.  Equal
+//keys share an id, so equality is an integer compare; ordering still compares the bytes,
+//so records sort the same in both builds.  Reads like a string: converts to std::string_view/std::string and compares
+//with them
+class InternedKey {
+public:
+    InternedKey();  //"", which is always interned first, held forever and never counted
+    InternedKey(std::string_view key);  //interns key
+    InternedKey(const InternedKey& other);
+    InternedKey(InternedKey&& other) noexcept;
+    InternedKey& operator=(InternedKey other) noexcept;
+    ~InternedKey();
+    static bool lookup(std::string_view key, InternedKey& out); //out = key if it is interned now, never adds it
+
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    const char* data() const { return KeyArena::instance().data(id); }
+    std::string_view view() const { return std::string_view(data(), length); }
+    operator std::string_view() const { return view(); }
+    operator std::string() const { return std::string(view()); }
+
+    friend bool operator==(const InternedKey& a, const InternedKey& b) { return a.id == b.id; }
+    friend bool operator!=(const InternedKey& a, const InternedKey& b) { return a.id != b.id; }
+    friend bool operator<(const InternedKey& a, const InternedKey& b) { return a.id != b.id && a.view() < b.view(); }
+    friend bool operator==(const InternedKey& a, std::string_view b) { return a.length == b.size() && a.view() == b; }
+    friend bool operator==(std::string_view a, const InternedKey& b) { return b == a; }
+    friend bool operator!=(const InternedKey& a, std::string_view b) { return !(a == b); }
+    friend bool operator!=(std::string_view a, const InternedKey& b) { return !(b == a); }
+    friend bool operator<(const InternedKey& a, std::string_view b) { return a.view() < b; }
+    friend bool operator<(std::string_view a, const InternedKey& b) { return a < b.view(); }
+    //exact overloads so string literals and std::strings don't have to choose between the conversions above
+    friend bool operator==(const InternedKey& a, const char* b) { return a == std::string_view(b); }
+    friend bool operator!=(const InternedKey& a, const char* b) { return !(a == std::string_view(b)); }
+    friend bool operator==(const InternedKey& a, const std::string& b) { return a == std::string_view(b); }
+    friend bool operator!=(const InternedKey& a, const std::string& b) { return !(a == std::string_view(b)); }
+
+private:
+    uint32_t id;
+    uint32_t length;
+
+    InternedKey(uint32_t id, uint32_t length);  //takes over a reference the caller holds
+};
+
+using RecordKey = InternedKey;
+#else
+using RecordKey = std::string;  //build with -DAVL_INTERNED_KEYS to intern keys instead
+#endif
 
 class Record {
 public:
-    std::string key;
+    RecordKey key;
     int value;
 
-    Record(const std::string& k, int v);
+    Record(std::string k, int v);
 };
 
-//Function pointers to comparison functions for setting priority_queue to minheap instead of maxheap
-struct RecordPtrCmp1 {
-    bool operator()(const Record* a, const Record* b) const
-    {
-        return a->value < b->value;
-    }
+//Matches the record with this key among records sharing a value, for RecordTree::find()/erase().  With interned keys
+//the probe holds the key's id, so every comparison on the way down is an integer compare
+struct RecordKeyMatch {
+#ifdef AVL_INTERNED_KEYS
+    InternedKey key;
+#else
+    std::string_view key;
+#endif
+    bool operator()(const Record* r) const { return r->key == key; }
 };
-struct RecordPtrCmp2 {
-    bool operator()(const Record* a, const Record* b) const
-    {
-        return a->value > b->value;
-    }
+
+//RecordTree's Tie: records sharing a value are ordered by key, so a RecordKeyMatch lookup is a single O(log n) descent
+//however many records share the value
+struct RecordKeyOrder {
+    bool operator()(const Record* a, const Record* b) const { return a->key < b->key; }
+    bool operator()(const Record* a, const RecordKeyMatch& b) const { return a->key < b.key; }
+    bool operator()(const RecordKeyMatch& a, const Record* b) const { return a.key < b->key; }
 };
 
-class AVLNode {
-public:
-    Record* record;
-    AVLNode* left;
-    AVLNode* right;
-    int height;
+//IndexedDatabase's tree: Record::value is the key, held inline in each node, and the payload is the record pointer.
+//Records are ordered by (value, key), and every node also keeps the sum/min/max of the values below it for
+//IndexedDatabase::aggregateRange()
+using RecordTree = AVLTree<int, Record*, std::less<int>, AVLKeySummary<int>, RecordKeyOrder>;
 
-    AVLNode(Record* r);
+//Result of IndexedDatabase::aggregateRange(): statistics over the values of the records in a range, all 0 when empty
+struct RangeAggregate {
+    int count = 0;
+    long long sum = 0;
+    int min = 0;
+    int max = 0;
+
+    double average() const; //0 when count is 0
 };
 
-class AVLTree {
+//Secondary index from Record::key to records: open addressing with linear probing and backward-shift deletion (no
+//tombstones), so lookups by std::string_view never allocate.  Keys are viewed in place inside the records, which
+//must outlive their entries.  Records sharing a key each get their own entry
+class KeyIndex {
 private:
-    AVLNode* root;
-
-    int height(AVLNode* node) const;
-    int balance(AVLNode* node) const;
-    
-    AVLNode* rotateRight(AVLNode* y);
-    AVLNode* rotateLeft(AVLNode* x);
-    AVLNode* doBalance(AVLNode* a);
+    struct Slot {
+        size_t hash;
+        Record* record; //nullptr = empty slot
+    };
 
-    void updateHeight(AVLNode* a);
+    std::vector<Slot> slots;    //capacity is a power of two, kept at most half full
+    size_t used;
 
-    AVLNode* insertHelper(AVLNode* node, Record* r);
-    Record* searchHelper(AVLNode* node, const std::string& key, int value) const;
-    std::vector<Record*> iotHelper(AVLNode* a) const;
-    std::vector<Record*> rangeQueryHelper(AVLNode* a, int start, int end) const;
-    AVLNode* deleteHelper(AVLNode* node, const std::string& key, int value);
+    size_t mask() const;
+    void grow();
 
 public:
-    AVLTree();
+    KeyIndex();
     void insert(Record* record);
-    Record* search(const std::string& key, int value) const;
-    std::vector<Record*> inorderTraversal() const;
+    Record* find(std::string_view key) const;   //some record with this key, nullptr if none
+    bool erase(Record* record); //removes this exact record's entry
+    void clear();
+    size_t size() const;
+};
+
+//Immutable, read-optimized copy of a database, made by IndexedDatabase::freeze().  Values are laid out in Eytzinger
+//(BFS) order in one cache-line aligned int array, so a lookup is a branchless descent that prefetches four levels
+//ahead instead of chasing left/right/record pointers.  Values and records are also kept in sorted arrays, so range
+//scans and nearest-key walks are plain array sweeps.  Answers search/rangeQuery/findKNearestKeys exactly like
+//AVLTree.  The records themselves are shared, not copied, so they must outlive the index
+class FrozenIndex {
+private:
+    std::vector<int> eytzStorage;   //over-allocated so the layout can start on a cache line
+    size_t eytzOffset;  //position of Eytzinger slot 0 (unused, slots are 1-based) in eytzStorage
+    std::vector<int> eytzRank;  //sorted position of the value in each Eytzinger slot
+    std::vector<int> values;    //sorted values
+    std::vector<Record*> records;   //records in the same order as values
+
+    const int* eytz() const;
+    void fill(const std::vector<int>& sorted, size_t k, size_t& next);
+    int lowerBound(int value) const;    //sorted position of first value >= value
+    int upperBound(int value) const;    //sorted position of first value > value
+    std::vector<Record*> nearestHelper(int key, int k, long long radius) const;
+
+public:
+    FrozenIndex();
+    explicit FrozenIndex(const std::vector<Record*>& sorted);
+    FrozenIndex(const FrozenIndex&) = delete;   //a copied vector loses the cache-line alignment
+    FrozenIndex& operator=(const FrozenIndex&) = delete;
+    FrozenIndex(FrozenIndex&&) = default;
+    FrozenIndex& operator=(FrozenIndex&&) = default;
+
+    Record* search(const std::string& key, int value) const;    //misses return the calling thread's empty record, like IndexedDatabase::search()
+    Record* find(std::string_view key, int value) const;    //nullptr on a miss
     std::vector<Record*> rangeQuery(int start, int end) const;
+    void rangeQuery(int start, int end, std::vector<Record*>& out) const;
+    template<typename Visitor>
+    bool rangeQuery(int start, int end, Visitor visit) const;
     std::vector<Record*> findKNearestKeys(int key, int k) const;
-    void deleteNode(const std::string& key, int value);
-    void deleteAll();
-    void deleteAllHelper(AVLNode* node);
+    std::vector<Record*> findKNearestKeysWithin(int key, int k, int radius) const;
+    std::vector<Record*> inorderTraversal() const;
+    int countRecords() const;
+};
+
+template<typename Visitor>
+bool FrozenIndex::rangeQuery(int start, int end, Visitor visit) const {
+    for(int i = lowerBound(start), n = values.size(); i < n && values[i] <= end; i++) {
+        if(!visit(records[i]))
+            return false;
+    }
+    return true;
+}
+
+//Append-only redo log of database changes.  Each entry is [payload length][checksum][op][value][key bytes]; append()
+//only buffers, and the buffered group is written and fdatasync'd together once groupSize entries are pending or on
+//commit(), so one sync covers many writes.  Entries not yet committed are lost on a crash.  A failed group commit is
+//rolled back off the file and its entries stay buffered, so the next commit() retries them.  A log may start with a
+//GENERATION entry naming its checkpoint generation, which tells recovery whether a snapshot already covers it
+class WriteAheadLog {
+public:
+    //DELETE_RANGE's key bytes hold the int32 end, GENERATION's the uint64 generation
+    enum Op : unsigned char { INSERT = 1, DELETE = 2, CLEAR = 3, DELETE_RANGE = 4, GENERATION = 5 };
 
+    WriteAheadLog();
+    ~WriteAheadLog();   //commits whatever is still buffered
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    bool open(const std::string& path, size_t groupSize, size_t validLength);   //appends after the first validLength bytes
+    void close();
+    bool isOpen() const;
+    bool append(Op op, std::string_view key, int value);    //false if this append's group commit failed
+    bool commit();  //writes and syncs the buffered group
+    bool failed() const;    //the last group commit failed, its entries are still buffered
+    bool truncate(uint64_t generation); //drops every entry and starts the log over at generation, once a checkpoint covers them
+
+    //Calls apply for every intact entry in order, stopping at the first torn or corrupt one (a crash mid-write).
+    //Returns the byte length of the intact prefix, or -1 if the file can't be read (a missing file is an empty log)
+    static long long replay(const std::string& path, const std::function<void(Op, std::string_view, int)>& apply);
+
+private:
+    int fd;
+    std::string buffer; //encoded entries waiting for the next group commit
+    size_t pending; //entries in buffer
+    size_t groupSize;
+    bool commitFailed;
 };
 
+//Read-only view of an on-disk snapshot, mmap'ed so it can answer queries as soon as it is opened.  The file is a
+//header, the sorted int32 value column, count+1 uint32 key offsets and the string heap the offsets point into.  The
+//header also records the log generation the snapshot was checkpointed at (0 for snapshots written outside checkpoint()),
+//and from version 2 on records sharing a value are stored in key order, as the tree keeps them
+class MappedSnapshot {
+public:
+    MappedSnapshot();
+    ~MappedSnapshot();
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+    uint64_t generation() const;    //logs of an older generation are covered by this snapshot
+    size_t count() const;
+    int value(size_t i) const;
+    std::string_view key(size_t i) const;
+    size_t lowerBound(int value) const; //position of the first value >= value
+    bool contains(std::string_view key, int value) const;
+    template<typename Visitor>
+    bool rangeQuery(int start, int end, Visitor visit) const;   //calls visit(key, value) in order, stops when it returns false
+
+    static bool write(const std::string& path, const std::vector<Record*>& sorted, uint64_t generation = 0); //atomically replaces path
+
+private:
+    void* base; //mapping, nullptr if not open
+    size_t length;
+    uint64_t gen;
+    bool keyOrdered;    //runs of equal values are sorted by key (version 2 files)
+    size_t n;
+    const int32_t* values;
+    const uint32_t* offsets;
+    const char* heap;
+};
+
+template<typename Visitor>
+bool MappedSnapshot::rangeQuery(int start, int end, Visitor visit) const {
+    for(size_t i = lowerBound(start); i < n && values[i] <= end; i++) {
+        if(!visit(key(i), values[i]))
+            return false;
+    }
+    return true;
+}
+
 class IndexedDatabase {
 private:
-    AVLTree index;
+    RecordTree index;
+    bool keyIndexed;
+    KeyIndex keys;  //maintained only while keyIndexed
+    WriteAheadLog log;  //every change is appended here while open
+    uint64_t logGeneration; //checkpoint generation of the log (and of the snapshot loaded or written last)
+    std::unordered_set<Record*> ownedRecords;   //records the database created itself (recovery) and must free
+
+#ifdef AVL_STATS
+    mutable LatencyRecorder latency[DatabaseStats::OP_COUNT];
+#endif
+
+    Record* adopt(Record&& record);
+    Record* adopt(std::string_view key, int value);
+    void release(Record* removed);
+    void clearContents();
 
 public:
-    void insert(Record* record);
+    IndexedDatabase();
+    ~IndexedDatabase();
+    void insert(Record* record);    //the caller keeps ownership, record must outlive its time in the database
+    Record* insert(Record&& record);    //moves record into one the database owns and frees on delete/clear
+    Record* emplace(std::string key, int value);    //creates an owned record in place
+    void bulkLoad(std::vector<Record*> records, bool presorted = false);
+    void insertBatch(std::vector<Record*> records, bool presorted = false);
+    Record* find(std::string_view key, int value) const;    //O(log n), nullptr if no record has this key and value, never allocates
+    //Compatibility form of find(): a miss returns an empty record ("", 0) instead of nullptr.  The empty record
+    //belongs to the calling thread and is reset by its next miss, so don't keep it.  It used to be a fresh
+    //allocation the caller owned; it no longer is, and deleting it is undefined behaviour
     Record* search(const std::string& key, int value) const;
     void deleteRecord(const std::string& key, int value);
+#ifdef AVL_INTERNED_KEYS
+    Record* find(const InternedKey& key, int value) const;  //key already interned (e.g. another record's), no lookup by string
+    void deleteRecord(const InternedKey& key, int value);
+#endif
     std::vector<Record*> rangeQuery(int start, int end) const;
+    void rangeQuery(int start, int end, std::vector<Record*>& out) const;
+    template<typename Visitor>
+    bool rangeQuery(int start, int end, Visitor visit) const;
     std::vector<Record*> findKNearestKeys(int key, int k) const;
+    std::vector<Record*> findKNearestKeysWithin(int key, int k, int radius) const;
+    //batched reads, one result per probe in probe order.  searchBatch() gives nullptr where search() would miss,
+    //rangeQueryBatch() exactly what rangeQuery() would return.  Search probes descend in interleaved, prefetching
+    //groups; ranges share one pass over the tree
+    std::vector<Record*> searchBatch(const std::vector<std::pair<std::string, int>>& probes) const;
+    std::vector<std::vector<Record*>> rangeQueryBatch(const std::vector<std::pair<int, int>>& ranges) const;
     std::vector<Record*> inorderTraversal() const;
     void clearDatabase();
+    //Range moves on values, built on the tree's split/join: O(log n) plus O(1) per record removed or moved
+    int deleteRange(int start, int end);    //deletes every record with start <= value <= end, returns how many
+    //Moves those records into a new database with this one's key index and persistence settings.  Owned records
+    //move with it
+    std::unique_ptr<IndexedDatabase> extractRange(int start, int end);
+    //Moves every record of other into this database, leaving other empty.  O(log n) when their values don't overlap,
+    //plus O(1) per record of other that is owned, logged or key indexed.  Nothing may be reading other
+    void merge(IndexedDatabase& other);
     int countRecords() const;
+    int rank(int value) const;
+    Record* select(int i) const;
+    int countInRange(int start, int end) const;
+    int countEqual(int value) const;    //records with this value, O(log n)
+    RangeAggregate aggregateRange(int start, int end) const;    //O(log n) count/sum/min/max of values in [start, end]
+    Record* percentile(double p) const;
+
+    using iterator = RecordTree::iterator;
+    using Snapshot = RecordTree::Snapshot;
+
+    iterator begin() const;
+    iterator end() const;
+    iterator lower_bound(int value) const;
+    iterator upper_bound(int value) const;
+    std::pair<iterator, iterator> equalRange(int value) const;  //the records with this value, in key order
+
+    void setPersistent(bool on);
+    Snapshot snapshot() const;
+
+    FrozenIndex freeze() const; //O(n) read-only copy for read-mostly tables
+
+    //optional secondary index on Record::key.  Maintained by the writer, not covered by snapshots
+    void setKeyIndex(bool on);
+    Record* findByKey(std::string_view key) const;  //O(1), nullptr if no record has key
+    bool deleteByKey(std::string_view key); //O(1) lookup plus the tree delete, false if no record has key
+
+    //durability: snapshot + write-ahead log.  Records loaded from disk are owned (and freed) by the database
+    bool writeSnapshot(const std::string& path) const;
+    bool loadSnapshot(const std::string& path); //replaces the contents with the snapshot's records
+    bool openLog(const std::string& path, size_t groupSize = 64);   //starts logging changes, appending to path
+    bool syncLog(); //commits the pending group now
+    bool logFailed() const; //a group commit failed, its changes are buffered until a later commit or syncLog() succeeds
+    void closeLog();
+    //Loads the snapshot (a missing file is an empty database) and replays the log unless the snapshot already covers
+    //it.  Fails, without touching the contents, if the snapshot exists but can't be read
+    bool recover(const std::string& snapshotPath, const std::string& logPath, size_t groupSize = 64);
+    bool checkpoint(const std::string& snapshotPath);   //writes a snapshot and empties the log it covers
+
+    DatabaseStats stats() const;    //counters and latency histograms, dump with toText()/toJson()
+    void resetStats();
+    bool checkInvariants() const;
+};
+
+#ifdef AVL_STATS
+//Records the lifetime of the scope into a LatencyRecorder
+class LatencyScope {
+private:
+    LatencyRecorder& recorder;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit LatencyScope(LatencyRecorder& r) : recorder(r), start(std::chrono::steady_clock::now()) {}
+    ~LatencyScope() {
+        recorder.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
 };
+#endif
+
+template<typename Visitor>
+bool IndexedDatabase::rangeQuery(int start, int end, Visitor visit) const {
+    AVL_STAT(LatencyScope timer(latency[DatabaseStats::RANGE_QUERY]));
+    return index.rangeQuery(start, end, visit); //call on db's tree
+}
 
 #endif // AVL_DATABASE_HPP
\ No newline at end of file
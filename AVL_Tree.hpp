@@ -0,0 +1,2210 @@
+#ifndef AVL_TREE_HPP
+#define AVL_TREE_HPP
+
+#include <vector>
+#include <cstddef>  //for ptrdiff_t in AVLIterator
+#include <iterator> //for bidirectional_iterator_tag in AVLIterator
+#include <atomic>   //for the published root and reader epochs in persistent mode
+#include <mutex>    //for the writer lock in persistent mode
+#include <utility>  //for pair in the retired node list and bulk entries
+#include <functional>   //for std::less, hash<thread::id> in pinReader() and retired payload releases
+#include <optional> //for erase() results
+#include <type_traits>  //for the compile-time key and node specializations
+#include <new>  //for operator new/placement new in AVLNodePool
+#include <thread>   //for this_thread in pinReader()
+#include <algorithm>    //for reverse() in nearestHelper(), merge() in mergeSorted(), sort() of batch probes
+#include <numeric>  //for iota() over batch probes
+#include <cmath>    //for log2() in insertBatch()
+#include <climits>  //for ULLONG_MAX in reclaim()
+#include <cstdlib>  //for abs() in checkHelper()
+
+//Hot-path instrumentation: compile with -DAVL_STATS to count rotations, visited nodes, node allocations and
+//per-operation latency.  Without it AVL_STAT() expands to nothing, so the hot paths carry no extra code or state
+#ifdef AVL_STATS
+#define AVL_STAT(statement) statement
+#else
+#define AVL_STAT(statement)
+#endif
+
+//Counters reported by AVLTree::stats().  height and size are always filled in, the rest only with AVL_STATS
+struct AVLTreeStats {
+    int height = 0;
+    int size = 0;
+    unsigned long long rotationsLeft = 0;
+    unsigned long long rotationsRight = 0;
+    unsigned long long searches = 0;
+    unsigned long long searchNodesVisited = 0;
+    unsigned long long rangeQueries = 0;
+    unsigned long long rangeNodesVisited = 0;
+    unsigned long long nodeAllocations = 0;
+    unsigned long long nodeReleases = 0;
+    unsigned long long slabAllocations = 0;
+};
+
+#ifdef AVL_STATS
+//Bumps a counter that concurrent snapshot readers may also bump.  Relaxed load+store rather than fetch_add keeps it
+//a plain increment; concurrent bumps can occasionally be lost, which is fine for statistics
+inline void avlStatBump(std::atomic<unsigned long long>& counter, unsigned long long n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+#endif
+
+//Links every tree node carries.  AVLNode derives from it to hold its payload inline; in intrusive mode caller-owned
+//objects derive from it instead, so the tree links them directly without allocating anything
+template<typename Node>
+struct AVLHook {
+    Node* left = nullptr;
+    Node* right = nullptr;
+    unsigned long long version = 0; //write that created this node, in persistent mode only nodes of the current write may be modified
+    int height = 1;
+    int size = 1;   //number of nodes in the subtree rooted here (order-statistic augmentation)
+};
+
+//Default Aggregate of an AVLTree: nodes carry no subtree summary and maintaining it costs nothing
+struct AVLNoAggregate {
+    struct type {};
+    template<typename Key, typename Value>
+    static type of(const Key&, const Value&) { return type(); }
+    static type combine(const type&, const type&) { return type(); }
+};
+
+//Aggregate keeping the sum, minimum and maximum key of every subtree, so aggregateRange() answers in O(log n).
+//Integral keys sum in long long, floating keys in double
+template<typename Key>
+struct AVLKeySummary {
+    using Sum = std::conditional_t<std::is_integral_v<Key>, long long, double>;
+    struct type {
+        Sum sum = 0;
+        Key min = Key();
+        Key max = Key();
+        bool operator==(const type& other) const { return sum == other.sum && min == other.min && max == other.max; }
+    };
+    template<typename Value>
+    static type of(const Key& key, const Value&) { return type{static_cast<Sum>(key), key, key}; }
+    static type combine(const type& a, const type& b) { //a covers smaller keys than b
+        return type{a.sum + b.sum, a.min, b.max};
+    }
+};
+
+//Default Tie of an AVLTree: entries with equal keys stay in insertion order, and find()/erase() look through all of
+//them for one their Match accepts
+struct AVLInsertionOrder {};
+
+//Result of aggregateRange(): how many entries the range holds and their combined summary (meaningless when count is 0)
+template<typename Summary>
+struct AVLAggregate {
+    int count = 0;
+    Summary summary{};
+};
+
+//Node of a tree that owns its entries: the key and payload sit inline, so comparisons read node->key with no extra hop.
+//summary covers the whole subtree rooted here and is empty unless the tree has an Aggregate
+template<typename Key, typename Value, typename Aggregate>
+struct AVLNode : AVLHook<AVLNode<Key, Value, Aggregate>> {
+    Key key;
+    typename Aggregate::type summary;
+    Value value;
+
+    AVLNode(const Key& k, const Value& v) : key(k), summary(Aggregate::of(k, v)), value(v) {}
+};
+
+//Pass as the Value of an AVLTree to make it intrusive: the tree links caller-owned T objects (T derives from
+//AVLHook<T>) and reads their key with KeyOf()(const T&).  Objects must stay put while linked, nothing is allocated or
+//freed, and persistent mode isn't available since nodes can't be copied
+template<typename T, typename KeyOf>
+struct AVLIntrusive {};
+
+//How the tree reads its nodes: inline mode hands out the payload, intrusive mode the linked object itself
+template<typename Key, typename Value, typename Aggregate>
+struct AVLNodeTraits {
+    using Node = AVLNode<Key, Value, Aggregate>;
+    using value_type = Value;
+    using reference = const Value&;
+    using pointer = const Value*;
+    using entry_type = std::pair<Key, Value>;   //what bulk operations take
+    static constexpr bool intrusive = false;
+
+    static const Key& key(const Node* n) { return n->key; }
+    static reference ref(const Node* n) { return n->value; }
+    static pointer ptr(const Node* n) { return &n->value; }
+    static value_type get(const Node* n) { return n->value; }
+    static entry_type entry(const Node* n) { return entry_type(n->key, n->value); }
+    static const Key& entryKey(const entry_type& e) { return e.first; }
+    static reference entryRef(const entry_type& e) { return e.second; }
+};
+
+template<typename Key, typename T, typename KeyOf, typename Aggregate>
+struct AVLNodeTraits<Key, AVLIntrusive<T, KeyOf>, Aggregate> {
+    static_assert(std::is_same_v<Aggregate, AVLNoAggregate>, "intrusive nodes have nowhere to keep a subtree summary");
+    using Node = T;
+    using value_type = T*;
+    using reference = T&;
+    using pointer = T*;
+    using entry_type = T*;
+    static constexpr bool intrusive = true;
+
+    static decltype(auto) key(const Node* n) { return KeyOf()(*n); }
+    static reference ref(const Node* n) { return *const_cast<T*>(n); }
+    static pointer ptr(const Node* n) { return const_cast<T*>(n); }
+    static value_type get(const Node* n) { return const_cast<T*>(n); }
+    static entry_type entry(const Node* n) { return const_cast<T*>(n); }
+    static decltype(auto) entryKey(const entry_type& e) { return KeyOf()(*e); }
+    static reference entryRef(const entry_type& e) { return *e; }
+};
+
+//Distance used by the nearest-key queries, only defined for arithmetic keys.  Integral keys measure in unsigned long
+//long, which holds the gap between any two 64-bit keys, floating keys in their own type.  Symmetric, so it holds
+//whichever way Compare orders the keys
+template<typename Key, typename Enable = void>
+struct AVLKeyDistance {
+    using type = Key;
+    static constexpr bool defined = false;
+};
+
+template<typename Key>
+struct AVLKeyDistance<Key, std::enable_if_t<std::is_integral_v<Key>>> {
+    using type = unsigned long long;
+    static constexpr bool defined = true;
+    static type between(Key a, Key b) { //modular subtraction of the smaller from the larger is exact even across zero
+        return a < b ? static_cast<type>(b) - static_cast<type>(a) : static_cast<type>(a) - static_cast<type>(b);
+    }
+};
+
+template<typename Key>
+struct AVLKeyDistance<Key, std::enable_if_t<std::is_floating_point_v<Key>>> {
+    using type = Key;
+    static constexpr bool defined = true;
+    static type between(Key a, Key b) {
+        return a < b ? b - a : a - b;
+    }
+};
+
+//Slab/arena allocator for tree nodes.  Nodes are carved out of fixed-size slabs instead of one new per insert,
+//freed nodes go on a free list (threaded through the freed memory) to be reused by later inserts,
+//and releaseAll() drops every slab at once instead of walking the tree node by node
+template<typename Node>
+class AVLNodePool {
+private:
+    static const int SLAB_NODES = 1024;   //nodes per slab
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+    static_assert(sizeof(Node) >= sizeof(FreeSlot), "a released node must be able to hold the free list link");
+
+    std::vector<Node*> slabs;   //raw storage, each slab holds SLAB_NODES nodes
+    FreeSlot* freeList; //singly linked list of released nodes
+    FreeSlot* freeTail; //last slot of freeList, valid while freeList isn't empty
+    int slabUsed;   //number of nodes handed out from the newest slab
+#ifdef AVL_STATS
+    unsigned long long allocations, releases, slabAllocations;  //only touched by the writer
+#endif
+
+public:
+    AVLNodePool();
+    ~AVLNodePool();
+    AVLNodePool(const AVLNodePool&) = delete;   //slabs are owned, copying would double free them
+    AVLNodePool& operator=(const AVLNodePool&) = delete;
+
+    template<typename... Args>
+    Node* allocate(Args&&... args);
+    void release(Node* node);
+    void releaseAll();  //skips destructors, only for trivially destructible nodes
+    void absorb(AVLNodePool& other);    //takes over other's slabs and free list, so its nodes now live in this pool
+    void addStats(AVLTreeStats& out) const;
+    void resetStats();
+};
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+class AVLTree;
+
+//Bidirectional in-order iterator over an AVLTree.  Keeps the root-to-current path on a fixed-size stack
+//instead of parent pointers, so stepping never allocates.  Invalidated by any insert/delete on the tree.
+template<typename Traits>
+class AVLIterator {
+private:
+    using Node = typename Traits::Node;
+
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = typename Traits::value_type;
+    using difference_type = std::ptrdiff_t;
+    using reference = typename Traits::reference;
+    using pointer = std::remove_reference_t<reference>*;
+
+    AVLIterator();  //end() of an empty tree
+
+    reference operator*() const;
+    pointer operator->() const;
+    decltype(auto) key() const { return Traits::key(path[depth - 1]); }
+    AVLIterator& operator++();
+    AVLIterator operator++(int);
+    AVLIterator& operator--();  //decrementing end() moves to the last entry
+    AVLIterator operator--(int);
+    bool operator==(const AVLIterator& other) const;
+    bool operator!=(const AVLIterator& other) const;
+
+private:
+    template<typename, typename, typename, typename, typename> friend class AVLTree;
+    static const int MAX_DEPTH = 64;    //AVL height is < 1.45*log2(n+2), 64 covers any tree that fits in memory
+
+    Node* root;
+    Node* path[MAX_DEPTH];  //path[0] is root, path[depth-1] is the current node
+    int depth;  //0 means end()
+
+    explicit AVLIterator(Node* r);
+    Node* node() const { return path[depth - 1]; }
+    void pushLeftmost(Node* node);
+    void pushRightmost(Node* node);
+};
+
+//Order-statistic AVL tree of (Key, Value) entries ordered by Compare.  Equal keys are allowed and kept in insertion
+//order, or ordered by Tie(const Value&, const Value&) when one is given, which makes the tree sorted by the composite
+//(key, payload).  Value is stored inline in the node, or pass AVLIntrusive<T, KeyOf> to link caller-owned objects
+//instead.  Integral keys with the default comparator compare natively, and arithmetic keys get the nearest-key queries
+template<typename Key, typename Value, typename Compare = std::less<Key>, typename Aggregate = AVLNoAggregate,
+         typename Tie = AVLInsertionOrder>
+class AVLTree {
+private:
+    using Traits = AVLNodeTraits<Key, Value, Aggregate>;
+    using Node = typename Traits::Node;
+
+public:
+    using key_type = Key;
+    using value_type = typename Traits::value_type; //what queries return: the payload, or T* in intrusive mode
+    using pointer = typename Traits::pointer;   //find()/select() result, nullptr when there is none
+    using entry_type = typename Traits::entry_type; //(key, payload) pairs, or T* in intrusive mode
+    using distance_type = typename AVLKeyDistance<Key>::type;
+    using iterator = AVLIterator<Traits>;
+    using summary_type = typename Aggregate::type;
+    using aggregate_type = AVLAggregate<summary_type>;  //aggregateRange() result
+    static constexpr bool intrusive = Traits::intrusive;
+
+private:
+    //integral keys under the default ordering test equality with one == instead of two comparator calls
+    static constexpr bool NATIVE_KEYS = std::is_integral_v<Key> &&
+        (std::is_same_v<Compare, std::less<Key>> || std::is_same_v<Compare, std::less<>>);
+    static constexpr bool AGGREGATED = !std::is_same_v<Aggregate, AVLNoAggregate>;  //nodes keep subtree summaries
+    static const int BATCH_GROUP = 16;  //descents the batch reads run interleaved, so their cache misses overlap
+    static constexpr bool TIED = !std::is_same_v<Tie, AVLInsertionOrder>;   //equal keys are ordered by Tie
+    //A Match that Tie can order against payloads (both ways round) is a probe: find()/erase() descend straight to
+    //the entry equal to it instead of scanning every entry with an equal key
+    template<typename Match>
+    static constexpr bool PROBE = TIED && std::is_invocable_r_v<bool, const Tie&, typename Traits::reference, const Match&> &&
+        std::is_invocable_r_v<bool, const Tie&, const Match&, typename Traits::reference>;
+
+    Node* root; //the writer's view of the tree
+    AVLNodePool<Node> pool; //every node of this tree lives in pool (unused in intrusive mode)
+    Compare comp;
+    Tie tie;
+
+    //persistent (path-copying) mode state, see setPersistent()
+    static const int MAX_READERS = 128; //snapshots that can be pinned at the same time
+    bool persistent;
+    std::atomic<Node*> published;   //root that snapshots read, swapped in once a write is complete
+    std::recursive_mutex writeLock; //serializes writers, recursive so bulk operations can reuse insert()
+    int writeDepth; //nesting of WriteScopes, the outermost one publishes
+    unsigned long long writeVersion;    //version stamped on nodes created by the current write
+    std::atomic<unsigned long long> epoch;  //bumped by every publish
+    mutable std::atomic<unsigned long long> readerEpochs[MAX_READERS];  //epoch pinned by each reader slot, 0 = free
+    std::vector<Node*> pendingRetire;   //nodes replaced by the current write
+    std::vector<std::pair<unsigned long long, Node*>> retired; //(epoch, node) waiting until no reader can still see them
+    std::vector<std::pair<unsigned long long, std::function<void()>>> retiredPayloads;  //(epoch, release) from retire()
+
+#ifdef AVL_STATS
+    struct Counters {
+        std::atomic<unsigned long long> rotationsLeft{0}, rotationsRight{0};
+        std::atomic<unsigned long long> searches{0}, searchNodesVisited{0};
+        std::atomic<unsigned long long> rangeQueries{0}, rangeNodesVisited{0};
+    };
+    mutable Counters counters;
+#endif
+
+    class WriteScope;
+
+    bool less(const Key& a, const Key& b) const;
+    bool equal(const Key& a, const Key& b) const;
+    bool before(const Key& ka, typename Traits::reference a, const Key& kb, typename Traits::reference b) const;
+
+    int height(Node* node) const;
+    int size(Node* node) const;
+    int balance(Node* node) const;
+
+    Node* rotateRight(Node* y);
+    Node* rotateLeft(Node* x);
+    Node* doBalance(Node* a);
+    void rebalancePath(Node** path, int depth);
+
+    void updateHeight(Node* a);
+    void updateSummary(Node* node);
+
+    Node* newNode(const entry_type& entry);
+    Node* writable(Node* node);
+    void freeNode(Node* node);
+    void publish();
+    void reclaim();
+    int pinReader() const;
+
+    void linkNode(Node* fresh);
+    template<typename Match>
+    Node* locate(Node* node, const Key& key, Match& match, Node** path, int& depth) const;
+    template<typename Match>
+    std::optional<value_type> eraseHelper(const Key& key, Match match);
+    void deleteAllHelper(Node* node);
+    template<typename Visitor>
+    void eraseAllHelper(Node* node, Visitor& visit);
+    template<typename GoesLeft>
+    std::pair<Node*, Node*> splitHelper(Node* node, GoesLeft& goesLeft);
+    Node* joinHelper(Node* left, Node* mid, Node* right);
+    Node* concatHelper(Node* left, Node* right);
+    Node* removeFirst(Node* node, Node*& first);
+    Node* cutRange(const Key& start, const Key& end);
+    Node* combine(Node* a, Node* b);
+    Node* unionHelper(Node* a, Node* b);
+    Node* cloneHelper(Node* node);
+    template<typename Match>
+    pointer findHelper(Node* node, const Key& key, Match match) const;
+    void iotHelper(Node* a, std::vector<value_type>& out) const;
+    void entriesHelper(Node* a, std::vector<entry_type>& out) const;
+    void rangeQueryHelper(Node* a, const Key& start, const Key& end, std::vector<value_type>& out) const;
+    int countBelow(Node* r, const Key& value, bool inclusive) const;
+    void aggregateHelper(Node* node, const Key& start, const Key& end, bool checkStart, bool checkEnd, aggregate_type& acc) const;
+    template<typename Visitor>
+    void findBatchHelper(Node* node, const std::vector<Key>& keys, const int* order, int lo, int hi, Visitor& visit) const;
+    template<typename Visitor>
+    void findGroup(Node* node, const std::vector<Key>& keys, const int* order, int lo, int hi, Visitor& visit) const;
+    template<typename Visitor>
+    void equalHelper(Node* node, const Key& key, int probe, Visitor& visit) const;
+    template<typename Match, typename Visitor>
+    void matchGroup(Node* node, const std::vector<Key>& keys, const std::vector<Match>& matches, int lo, int hi, Visitor& visit) const;
+    template<typename KeyAt>
+    void boundGroup(Node* r, int n, KeyAt keyAt, iterator* out) const;
+    pointer selectHelper(Node* r, int i) const;
+    iterator beginHelper(Node* r) const;
+    iterator endHelper(Node* r) const;
+    iterator boundHelper(Node* r, const Key& value, bool strict) const;
+    std::vector<value_type> nearestHelper(Node* r, const Key& key, int k, const distance_type* radius) const;
+    Node* buildHelper(const entry_type* entries, int n);
+    int checkHelper(Node* node, const Node*& prev, bool& ok) const;
+
+public:
+    //Read-only view of the tree as it was when snapshot() was called.  In persistent mode it pins that version,
+    //so it stays valid and lock-free to read while writers carry on; otherwise it is only valid until the next write
+    class Snapshot {
+    public:
+        Snapshot(Snapshot&& other);
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        ~Snapshot();
+
+        template<typename Match>
+        pointer find(const Key& key, Match match) const;
+        pointer find(const Key& key) const;
+        std::vector<value_type> inorderTraversal() const;
+        std::vector<value_type> rangeQuery(const Key& start, const Key& end) const;
+        void rangeQuery(const Key& start, const Key& end, std::vector<value_type>& out) const;
+        template<typename Visitor>
+        bool rangeQuery(const Key& start, const Key& end, Visitor visit) const;
+        std::vector<value_type> findKNearestKeys(const Key& key, int k) const;
+        std::vector<value_type> findKNearestKeysWithin(const Key& key, int k, distance_type radius) const;
+        int count() const;
+        int rank(const Key& value) const;
+        pointer select(int i) const;
+        int countInRange(const Key& start, const Key& end) const;
+        aggregate_type aggregateRange(const Key& start, const Key& end) const;
+        template<typename Visitor>
+        void findBatch(const std::vector<Key>& keys, Visitor visit) const;
+        template<typename Match, typename Visitor>
+        void findBatch(const std::vector<Key>& keys, const std::vector<Match>& matches, Visitor visit) const;
+        template<typename Visitor>
+        void rangeQueryBatch(const std::vector<std::pair<Key, Key>>& ranges, Visitor visit) const;
+        iterator begin() const;
+        iterator end() const;
+        iterator lower_bound(const Key& value) const;
+        iterator upper_bound(const Key& value) const;
+
+    private:
+        friend class AVLTree;
+        const AVLTree* tree;
+        Node* root;
+        int slot;   //reader slot pinned in tree, -1 if none
+
+        Snapshot(const AVLTree* t, Node* r, int s);
+    };
+
+    explicit AVLTree(const Compare& c = Compare());
+    ~AVLTree();
+    AVLTree(const AVLTree&) = delete;
+    AVLTree& operator=(const AVLTree&) = delete;
+
+    void insert(const Key& key, const Value& value);    //equal keys go after the ones already there (or in Tie order)
+    template<bool I = intrusive, typename = std::enable_if_t<I>>
+    void insert(value_type object); //intrusive mode: links object, which must not be in any tree
+
+    //Looks key up among entries with an equal key for one that match(const Value&, or T& in intrusive mode) accepts,
+    //nullptr if none.  O(log n + entries with an equal key), or O(log n) when match is a probe Tie can order
+    template<typename Match>
+    pointer find(const Key& key, Match match) const;
+    pointer find(const Key& key) const; //any entry with an equal key
+    std::vector<value_type> inorderTraversal() const;
+    std::vector<value_type> rangeQuery(const Key& start, const Key& end) const;
+    void rangeQuery(const Key& start, const Key& end, std::vector<value_type>& out) const;   //appends into out instead of returning a new vector
+    template<typename Visitor>
+    bool rangeQuery(const Key& start, const Key& end, Visitor visit) const;   //calls visit(value_type) in order, stops early when it returns false
+    std::vector<value_type> findKNearestKeys(const Key& key, int k) const;
+    std::vector<value_type> findKNearestKeysWithin(const Key& key, int k, distance_type radius) const;  //only entries within radius of key
+
+    //Batched reads, probes in any order.  findBatch() calls visit(i, value_type) for every entry whose key equals
+    //keys[i], answering all keys in one shared descent; rangeQueryBatch() calls visit(i, value_type) for every entry in
+    //[ranges[i].first, ranges[i].second], each range in key order, in one merged sweep over the covered entries
+    template<typename Visitor>
+    void findBatch(const std::vector<Key>& keys, Visitor visit) const;
+    //find() for every (keys[i], matches[i]): calls visit(i, value_type) for the entry find() would return, skipping
+    //misses.  Probe matches go straight to their entry however many share the key, BATCH_GROUP descents at a time
+    template<typename Match, typename Visitor>
+    void findBatch(const std::vector<Key>& keys, const std::vector<Match>& matches, Visitor visit) const;
+    template<typename Visitor>
+    void rangeQueryBatch(const std::vector<std::pair<Key, Key>>& ranges, Visitor visit) const;
+
+    //Removes an entry with an equal key that match accepts (same argument as find()), returning its value (nullopt if none matched)
+    template<typename Match>
+    std::optional<value_type> erase(const Key& key, Match match);
+    template<bool I = intrusive, typename = std::enable_if_t<I>>
+    bool erase(value_type object);  //intrusive mode: unlinks object, false if it isn't in this tree
+    void deleteAll();
+
+    //Range removal and moves built on AVL split/join: cutting a range out and stitching the rest back together is
+    //O(log n), plus O(1) per entry removed (to free its node) or moved (to copy its node into out's pool)
+    int eraseRange(const Key& start, const Key& end);   //removes every entry with start <= key <= end, returns how many
+    template<typename Visitor>
+    int eraseRange(const Key& start, const Key& end, Visitor visit);    //calls visit(value_type) on each, in order, as it goes
+    int extractRange(const Key& start, const Key& end, AVLTree& out);   //moves them into out instead, returns how many
+    //Moves every entry of other into this tree (on equal keys this tree's entries stay first, as if other's were inserted), leaving other
+    //empty.  O(log n) when the two trees' key ranges don't overlap, since other's nodes and slabs are taken over
+    //rather than copied; O(m log(n/m + 1)) otherwise.  Nothing may be using other, snapshots included
+    void join(AVLTree& other);
+
+    //bulk operations, entries must already be sorted by key (and by Tie among equal keys)
+    void buildSorted(const std::vector<entry_type>& sorted);    //replaces the whole tree, O(n)
+    void mergeSorted(const std::vector<entry_type>& sorted);    //merges into the current tree and rebuilds it, O(n + m)
+    void insertBatch(const std::vector<entry_type>& sorted);    //picks mergeSorted() or one insert per entry, whichever is cheaper
+
+    //order statistics, all O(log n) except count() which is O(1)
+    int count() const;
+    int rank(const Key& value) const;
+    pointer select(int i) const;
+    int countInRange(const Key& start, const Key& end) const;
+
+    //Combined Aggregate summary and count of the entries with start <= key <= end, O(log n) from the summaries kept
+    //in every node.  Only for trees with an Aggregate
+    aggregate_type aggregateRange(const Key& start, const Key& end) const;
+
+    //in-order iteration.  In persistent mode iterate through a Snapshot instead, these aren't protected from concurrent writes
+    iterator begin() const;
+    iterator end() const;
+    iterator lower_bound(const Key& value) const;  //first entry with key >= value
+    iterator upper_bound(const Key& value) const;  //first entry with key > value
+
+    //Persistent mode: writers copy the path they change instead of modifying nodes in place and publish the new root
+    //atomically, so any number of reader threads can use snapshot() (and the read methods above, which take one
+    //internally) without locks while one writer at a time inserts/deletes.  Replaced nodes are freed once no pinned
+    //snapshot can reach them.  Switch modes only while no other thread is using the tree
+    void setPersistent(bool on);
+    bool isPersistent() const;
+    Snapshot snapshot() const;
+    //Runs release once no snapshot can still reach a payload just removed from the tree (so the caller can free what
+    //it owns), or right away outside persistent mode
+    void retire(std::function<void()> release);
+
+    AVLTreeStats stats() const;
+    void resetStats();
+    bool checkInvariants() const;   //O(n) self-check for tests: key order, heights, AVL balance, subtree sizes and summaries
+};
+
+template<typename Node>
+AVLNodePool<Node>::AVLNodePool() : freeList(nullptr), freeTail(nullptr), slabUsed(SLAB_NODES) {    //slabUsed full so first allocate() grabs a slab
+    AVL_STAT(allocations = releases = slabAllocations = 0);
+}
+
+template<typename Node>
+AVLNodePool<Node>::~AVLNodePool() {
+    for(auto slab : slabs)
+        ::operator delete(slab);
+}
+
+//Hands out a node, preferring recycled nodes from the free list, then the newest slab, then a fresh slab
+template<typename Node>
+template<typename... Args>
+Node* AVLNodePool<Node>::allocate(Args&&... args) {
+    AVL_STAT(allocations++);
+    void* slot;
+    if(freeList) {  //reuse a released node first, keeps the live nodes packed
+        slot = freeList;
+        freeList = freeList->next;
+    } else {
+        if(slabUsed == SLAB_NODES) {    //newest slab exhausted, grab another one
+            slabs.push_back(static_cast<Node*>(::operator new(sizeof(Node) * SLAB_NODES)));
+            slabUsed = 0;
+            AVL_STAT(slabAllocations++);
+        }
+        slot = slabs.back() + slabUsed++;
+    }
+    return new (slot) Node(std::forward<Args>(args)...);   //construct in place
+}
+
+//Destroys node and puts its memory on the free list for reuse.  Node memory stays in its slab until releaseAll()
+template<typename Node>
+void AVLNodePool<Node>::release(Node* node) {
+    AVL_STAT(releases++);
+    node->~Node();
+    FreeSlot* slot = new (static_cast<void*>(node)) FreeSlot{freeList};
+    if(!freeList)
+        freeTail = slot;
+    freeList = slot;
+}
+
+//Frees every slab at once, invalidating all nodes handed out by this pool
+template<typename Node>
+void AVLNodePool<Node>::releaseAll() {
+    for(auto slab : slabs)
+        ::operator delete(slab);
+    slabs.clear();
+    freeList = nullptr;
+    slabUsed = SLAB_NODES;
+}
+
+//O(slabs): other's slabs go in front of this pool's, so allocation carries on from this pool's newest slab (the
+//unused end of other's newest slab is given up), and other's free list is spliced onto this one.  other ends up empty
+template<typename Node>
+void AVLNodePool<Node>::absorb(AVLNodePool& other) {
+    slabs.insert(slabs.begin(), other.slabs.begin(), other.slabs.end());
+    if(other.freeList) {
+        other.freeTail->next = freeList;
+        if(!freeList)
+            freeTail = other.freeTail;
+        freeList = other.freeList;
+    }
+    other.slabs.clear();
+    other.freeList = nullptr;
+    other.slabUsed = SLAB_NODES;
+}
+
+template<typename Node>
+void AVLNodePool<Node>::addStats(AVLTreeStats& out) const {
+    (void)out;
+    AVL_STAT(out.nodeAllocations += allocations);
+    AVL_STAT(out.nodeReleases += releases);
+    AVL_STAT(out.slabAllocations += slabAllocations);
+}
+
+template<typename Node>
+void AVLNodePool<Node>::resetStats() {
+    AVL_STAT(allocations = releases = slabAllocations = 0);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+AVLTree<Key, Value, Compare, Aggregate, Tie>::AVLTree(const Compare& c)
+    : root(nullptr), comp(c), persistent(false), published(nullptr), writeDepth(0), writeVersion(0), epoch(1) {
+    for(auto& e : readerEpochs)
+        e.store(0);
+}
+
+//Nodes with a destructor to run (non-trivial keys/payloads) are released one by one, the pool frees the slabs.
+//Payloads still waiting in retire() are released too, no snapshot can outlive the tree
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+AVLTree<Key, Value, Compare, Aggregate, Tie>::~AVLTree() {
+    if constexpr(!intrusive && !std::is_trivially_destructible_v<Node>) {
+        deleteAllHelper(root);
+        for(auto& entry : retired)
+            pool.release(entry.second);
+        for(auto node : pendingRetire)
+            pool.release(node);
+    }
+    for(auto& entry : retiredPayloads)
+        entry.second();
+}
+
+//Brackets every public mutation.  In persistent mode it holds the writer lock, starts a new node version on entry
+//and publishes the new root on exit of the outermost scope.  Does nothing otherwise
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+class AVLTree<Key, Value, Compare, Aggregate, Tie>::WriteScope {
+private:
+    AVLTree& tree;
+    bool active;
+
+public:
+    explicit WriteScope(AVLTree& t) : tree(t), active(t.persistent) {
+        if(active) {
+            tree.writeLock.lock();
+            if(tree.writeDepth++ == 0)
+                tree.writeVersion++;
+        }
+    }
+    ~WriteScope() {
+        if(active) {
+            if(--tree.writeDepth == 0)
+                tree.publish();
+            tree.writeLock.unlock();
+        }
+    }
+};
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+bool AVLTree<Key, Value, Compare, Aggregate, Tie>::less(const Key& a, const Key& b) const {
+    if constexpr(NATIVE_KEYS)
+        return a < b;
+    else
+        return comp(a, b);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+bool AVLTree<Key, Value, Compare, Aggregate, Tie>::equal(const Key& a, const Key& b) const {
+    if constexpr(NATIVE_KEYS)
+        return a == b;
+    else
+        return !comp(a, b) && !comp(b, a);
+}
+
+//Whether entry (ka, a) comes strictly before (kb, b) in the tree's order: by key, then by Tie among equal keys
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+bool AVLTree<Key, Value, Compare, Aggregate, Tie>::before(const Key& ka, typename Traits::reference a, const Key& kb, typename Traits::reference b) const {
+    if(less(ka, kb))
+        return true;
+    if constexpr(TIED)
+        return !less(kb, ka) && tie(a, b);
+    else
+        return false;
+}
+
+//Makes a fresh node for entry: allocated from the pool, or in intrusive mode the object itself with its links reset
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::newNode(const entry_type& entry) -> Node* {
+    Node* node;
+    if constexpr(intrusive) {
+        node = entry;
+        node->left = node->right = nullptr;
+        node->height = node->size = 1;
+    } else
+        node = pool.allocate(entry.first, entry.second);
+    node->version = writeVersion;
+    return node;
+}
+
+//Returns a node that may be modified in place standing in for node: node itself unless persistent mode needs a copy
+//because node is shared with published versions.  Callers must link the returned node into its (writable) parent
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::writable(Node* node) -> Node* {
+    if constexpr(intrusive)
+        return node;
+    else {
+        if(!persistent || node->version == writeVersion)
+            return node;
+        Node* copy = pool.allocate(*node);
+        copy->version = writeVersion;
+        pendingRetire.push_back(node);  //readers may still be looking at node
+        return copy;
+    }
+}
+
+//Frees a node removed from the tree, or in persistent mode retires it if readers could still reach it.  Intrusive
+//nodes belong to the caller and are just dropped
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::freeNode(Node* node) {
+    if constexpr(!intrusive) {
+        if(!persistent || node->version == writeVersion)
+            pool.release(node);
+        else
+            pendingRetire.push_back(node);
+    }
+}
+
+//Makes the writer's root visible to new snapshots, then tags this write's replaced nodes with the epoch it ended
+//(readers pinned at or before that epoch might still hold them) and frees whatever no reader can reach anymore
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::publish() {
+    published.store(root);
+    unsigned long long e = epoch.fetch_add(1);
+    for(auto node : pendingRetire)
+        retired.push_back(std::make_pair(e, node));
+    pendingRetire.clear();
+    reclaim();
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::reclaim() {
+    unsigned long long oldest = ULLONG_MAX; //oldest epoch still pinned by a reader
+    for(auto& e : readerEpochs) {
+        unsigned long long pinned = e.load();
+        if(pinned && pinned < oldest)
+            oldest = pinned;
+    }
+    size_t kept = 0;
+    for(auto& entry : retired) {
+        if(entry.first < oldest)    //retired before every pinned reader started, unreachable now
+            pool.release(entry.second);
+        else
+            retired[kept++] = entry;
+    }
+    retired.resize(kept);
+    kept = 0;
+    for(auto& entry : retiredPayloads) {
+        if(entry.first < oldest)
+            entry.second();
+        else
+            retiredPayloads[kept++] = std::move(entry);
+    }
+    retiredPayloads.resize(kept);
+}
+
+//Claims a free reader slot, stamping it with the current epoch.  The slot is set before the root is loaded, so a
+//writer that misses the slot must have published before this reader loads the root
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::pinReader() const {
+    size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());    //spread threads over the slots
+    for(;;) {
+        for(int i = 0; i < MAX_READERS; i++) {
+            int s = (start + i) % MAX_READERS;
+            unsigned long long expected = 0;
+            if(readerEpochs[s].compare_exchange_strong(expected, epoch.load()))
+                return s;
+        }
+        std::this_thread::yield();  //every slot pinned, wait for a reader to finish
+    }
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::setPersistent(bool on) {
+    static_assert(!intrusive, "intrusive nodes belong to the caller and can't be path-copied");
+    if(on == persistent)
+        return;
+    if(on)
+        published.store(root);
+    else {  //caller guarantees no snapshots are outstanding, so everything retired can go
+        for(auto& entry : retired)
+            pool.release(entry.second);
+        retired.clear();
+        for(auto& entry : retiredPayloads)
+            entry.second();
+        retiredPayloads.clear();
+    }
+    persistent = on;
+}
+
+//Tagged with the current epoch: inside a write that is the epoch its removed nodes get too, after one it is later,
+//which only keeps the payload a little longer.  Runs with the next publish's reclaim()
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::retire(std::function<void()> release) {
+    if(!persistent) {
+        release();
+        return;
+    }
+    std::lock_guard<std::recursive_mutex> guard(writeLock);
+    retiredPayloads.push_back(std::make_pair(epoch.load(), std::move(release)));
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+bool AVLTree<Key, Value, Compare, Aggregate, Tie>::isPersistent() const {
+    return persistent;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::snapshot() const -> Snapshot {
+    if(!persistent)
+        return Snapshot(this, root, -1);
+    int slot = pinReader();
+    return Snapshot(this, published.load(), slot);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::Snapshot(const AVLTree* t, Node* r, int s) : tree(t), root(r), slot(s) {}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::Snapshot(Snapshot&& other) : tree(other.tree), root(other.root), slot(other.slot) {
+    other.slot = -1;    //pin moves with the snapshot
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::~Snapshot() {
+    if(slot >= 0)
+        tree->readerEpochs[slot].store(0);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::height(Node* node) const {
+    return node ? node->height : 0;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::size(Node* node) const {
+    return node ? node->size : 0;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::balance(Node* node) const {
+    return node ? height(node->left) - height(node->right) : 0;
+}
+
+/*  Check balance of node, balancing it with at most two rotations if required.  Assumes node exists and that its
+    children are already balanced with correct heights, which holds for every ancestor on an insert/delete path when
+    they are fixed bottom-up.  Returns the node now at the top of the subtree.
+*/
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::doBalance(Node* a) -> Node* {
+    a = writable(a);    //every path below ends up modifying a (persistent mode copies it first)
+    updateHeight(a);    //children may have changed height
+    if(balance(a) > 1) {    //unbalanced to the left
+        if(balance(a->left) < 0)    //left child is unbalanced to the right, which requires two rotations
+            a->left = rotateLeft(a->left);
+        return rotateRight(a);
+    } else if(balance(a) < -1) {    //unbalanced to the right
+        if(balance(a->right) > 0)   //right child is unbalanced to the left, which requires two rotations
+            a->right = rotateRight(a->right);
+        return rotateLeft(a);
+    }
+    return a;   //else not unbalanced (perfectly balanced -Thanos)
+}
+
+/*  Walks back up an insert/delete path from the deepest ancestor to the root, rebalancing each node and relinking the
+    result into its parent.  Every node on the path must already be writable and have its size adjusted.  Stops as soon
+    as a subtree comes out with the height it had before the update, since nothing above it can change then.
+*/
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::rebalancePath(Node** path, int depth) {
+    for(int i = depth - 1; i >= 0; i--) {
+        Node* node = path[i];
+        int oldHeight = node->height;
+        Node* top = doBalance(node);
+        if(i == 0)
+            root = top;
+        else if(path[i - 1]->left == node)
+            path[i - 1]->left = top;
+        else
+            path[i - 1]->right = top;
+        if(top->height == oldHeight) {  //height unchanged, ancestors are still balanced
+            if constexpr(AGGREGATED) {  //but their summaries still cover the changed subtree
+                while(--i >= 0)
+                    updateSummary(path[i]);
+            }
+            return;
+        }
+    }
+}
+
+//Assumes node exists, designed to be used in recursive functions to propagate in post-order fashion.  Could be changed so assumption not necessary and be solidly recursive-friendly
+//Also recomputes the subtree size, so every rotation/rebalance that fixes heights keeps sizes correct too
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::updateHeight(Node* node) {
+    if(height(node->left) >= height(node->right))   //correctly calculates height even with null nodes in left or right or both
+        node->height = height(node->left) + 1;
+    else
+        node->height = height(node->right) + 1;
+    node->size = size(node->left) + size(node->right) + 1;
+    updateSummary(node);
+}
+
+//Recombines node's subtree summary from its children's, in key order.  Compiles to nothing without an Aggregate
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::updateSummary(Node* node) {
+    if constexpr(AGGREGATED) {
+        summary_type s = Aggregate::of(node->key, node->value);
+        if(node->left)
+            s = Aggregate::combine(node->left->summary, s);
+        if(node->right)
+            s = Aggregate::combine(s, node->right->summary);
+        node->summary = s;
+    }
+}
+
+//Assumes y->left exists (a good assumption since this is (only?) called when y is unbalanced to the left)
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::rotateRight(Node* y) -> Node* {
+    //setup temp pointers prior to performing rotation
+    AVL_STAT(avlStatBump(counters.rotationsRight));
+    y = writable(y);
+    Node* yLeft = writable(y->left);
+    Node* yLeftRight = yLeft->right;
+    //perform rotation with temp pointer assistance
+    yLeft->right = y;
+    y->left = yLeftRight;
+
+    //update the two heights necessary (yLeftRight not necessary because its children aren't modified)
+    updateHeight(y);
+    updateHeight(yLeft);
+
+    return yLeft;   //was passed node, now return correctly rotated node
+}
+
+//Assumes x->right exists (a good assumption since this is (only?) called when y is unbalanced to the right)
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::rotateLeft(Node* x) -> Node* {
+    //setup temp pointers prior to performing rotation
+    AVL_STAT(avlStatBump(counters.rotationsLeft));
+    x = writable(x);
+    Node* xRight = writable(x->right);
+    Node* xRightLeft = xRight->left;
+    //perform rotation with temp pointer assistance
+    xRight->left = x;
+    x->right = xRightLeft;
+
+    //update the two heights necessary (xRightLeft not necessary because its children aren't modified)
+    updateHeight(x);
+    updateHeight(xRight);
+
+    return xRight;  //was passed node, now return correctly rotated node
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::insert(const Key& key, const Value& value) {
+    static_assert(!intrusive, "intrusive trees link objects, use insert(T*)");
+    WriteScope scope(*this);
+    linkNode(newNode(entry_type(key, value)));
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<bool I, typename>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::insert(value_type object) {
+    WriteScope scope(*this);
+    linkNode(newNode(object));
+}
+
+//Iterative: walks down by key recording the path, hangs fresh off the end, then rebalances only that path
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::linkNode(Node* fresh) {
+    Node* path[iterator::MAX_DEPTH];
+    int depth = 0;
+    Node** link = &root;    //the pointer the new node will be stored in
+    while(*link) {
+        Node* node = writable(*link);   //node's links/height/size change below
+        *link = node;
+        node->size++;   //fresh ends up somewhere below node
+        path[depth++] = node;
+        if(before(Traits::key(fresh), Traits::ref(fresh), Traits::key(node), Traits::ref(node)))  //before goes left, the rest right
+            link = &node->left;
+        else
+            link = &node->right;
+    }
+    *link = fresh;
+    rebalancePath(path, depth);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Match>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::find(const Key& key, Match match) const -> pointer {
+    return snapshot().find(key, match);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::find(const Key& key) const -> pointer {
+    return snapshot().find(key);
+}
+
+//Returns nullptr if no entry with an equal key is accepted by match
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Match>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::findHelper(Node* node, const Key& key, Match match) const -> pointer {
+    Node* path[iterator::MAX_DEPTH];
+    int depth = 0;
+    Node* found = locate(node, key, match, path, depth);
+    return found ? Traits::ptr(found) : nullptr;
+}
+
+/*  Finds the first entry (in order) with a key equal to key that match accepts, below node, and records the nodes
+    above it in path[depth..].  A probe match is one descent by (key, Tie).  Otherwise equal keys may sit on both
+    sides of any node that has one (rotations move them), so the equal entries are searched in order, left side
+    first, with the path rewound whenever a side comes up empty.  Returns nullptr if nothing matches.
+*/
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Match>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::locate(Node* node, const Key& key, Match& match, Node** path, int& depth) const -> Node* {
+    while(node) {
+        AVL_STAT(avlStatBump(counters.searchNodesVisited));
+        const Key& k = Traits::key(node);
+        bool left, right;
+        if constexpr(PROBE<Match>) {    //ties are broken by comparing the probe against node
+            left = less(key, k) || (!less(k, key) && tie(match, Traits::ref(node)));
+            right = !left && (less(k, key) || tie(Traits::ref(node), match));
+        } else {
+            left = less(key, k);
+            right = less(k, key);
+        }
+        if(left) {  //go down left if key lower
+            path[depth++] = node;
+            node = node->left;
+        } else if(right) {  //go down right if key higher
+            path[depth++] = node;
+            node = node->right;
+        } else if constexpr(PROBE<Match>)   //same key, same Tie position
+            return node;
+        else {  //equal key, anything matching on the left comes first
+            int above = depth;
+            path[depth++] = node;
+            if(Node* found = locate(node->left, key, match, path, depth))
+                return found;
+            depth = above;
+            if(match(Traits::ref(node)))
+                return node;
+            path[depth++] = node;   //then the right side, without recursing
+            node = node->right;
+        }
+    }
+    return nullptr;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Match>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::erase(const Key& key, Match match) -> std::optional<value_type> {
+    WriteScope scope(*this);
+    return eraseHelper(key, match);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<bool I, typename>
+bool AVLTree<Key, Value, Compare, Aggregate, Tie>::erase(value_type object) {
+    WriteScope scope(*this);
+    return eraseHelper(Traits::entryKey(object), [object](typename Traits::reference v) { return &v == object; }).has_value();
+}
+
+//Iterative: finds the node (and its successor if it has two children) recording the path, unlinks it, then rebalances
+//only that path.  The successor node is moved into the removed node's place rather than copying payloads around, so
+//intrusive objects keep their identity.  Nothing is copied or modified when no entry matches
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Match>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::eraseHelper(const Key& key, Match match) -> std::optional<value_type> {
+    Node* path[iterator::MAX_DEPTH];
+    int depth = 0;
+    Node* node = locate(root, key, match, path, depth);
+    if(!node)   //no entry with this key matched
+        return std::nullopt;
+
+    int target = depth; //path index of the matching node
+    path[depth++] = node;
+    if(node->left && node->right) { //two children: the successor (leftmost of the right subtree) takes node's place
+        Node* curr = node->right;
+        path[depth++] = curr;
+        while(curr->left) {
+            curr = curr->left;
+            path[depth++] = curr;
+        }
+    }
+
+    //make the path writable top-down, relinking each copy into its (already writable) parent
+    for(int i = 0; i < depth; i++) {
+        Node* w = writable(path[i]);
+        if(i == 0)
+            root = w;
+        else if(path[i - 1]->left == path[i])
+            path[i - 1]->left = w;
+        else
+            path[i - 1]->right = w;
+        path[i] = w;
+    }
+
+    Node* gone = path[target];
+    Node* replacement;  //what takes gone's place under its parent
+    if(depth > target + 1) {    //successor case
+        Node* succ = path[--depth];
+        if(path[depth - 1]->left == succ)   //unlink the successor, it has no left child
+            path[depth - 1]->left = succ->right;
+        else
+            path[depth - 1]->right = succ->right;
+        succ->left = gone->left;
+        succ->right = gone->right;
+        succ->height = gone->height;
+        succ->size = gone->size;
+        path[target] = succ;    //succ now sits on the path where gone was
+        replacement = succ;
+    } else {
+        replacement = gone->left ? gone->left : gone->right;    //at most one child
+        depth = target;
+    }
+    if(target == 0)
+        root = replacement;
+    else if(path[target - 1]->left == gone)
+        path[target - 1]->left = replacement;
+    else
+        path[target - 1]->right = replacement;
+
+    std::optional<value_type> removed(Traits::get(gone));
+    freeNode(gone);
+
+    for(int i = 0; i < depth; i++)  //every node left on the path lost one descendant, even above where rebalancing stops
+        path[i]->size--;
+    rebalancePath(path, depth);
+    return removed;
+}
+
+//O(1) in the number of nodes when it can: every node lives in the pool, so drop the slabs instead of walking the tree.
+//In persistent mode snapshots may still be reading the nodes, so they are retired one by one instead, and nodes
+//with destructors are released one by one too
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::deleteAll() {
+    WriteScope scope(*this);
+    if constexpr(!intrusive) {  //intrusive objects belong to the caller, just forget them
+        if(persistent || !std::is_trivially_destructible_v<Node>)
+            deleteAllHelper(root);
+        else
+            pool.releaseAll();
+    }
+    root = nullptr;
+}
+
+//Returns every node of the subtree at node to the pool's free list one by one
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::deleteAllHelper(Node* node) {
+    if(node) {  //recursive case: node exists, propagate to left and right branches
+        deleteAllHelper(node->left);
+        deleteAllHelper(node->right);
+        freeNode(node);    //release in post-order fashion
+    }
+    //base case: node does not exist/nullptr, do nothing
+}
+
+//deleteAllHelper() that shows each entry to visit, in order, before its node goes
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::eraseAllHelper(Node* node, Visitor& visit) {
+    if(node) {
+        eraseAllHelper(node->left, visit);
+        visit(Traits::get(node));
+        eraseAllHelper(node->right, visit);
+        freeNode(node);
+    }
+}
+
+/*  Splits the subtree at node into the entries goesLeft(node) accepts and the rest, which must be a prefix and a suffix
+    in tree order.  Each node on the search path is joined back onto the side it belongs to, and the joins along one
+    side telescope, so the whole split is O(log n).  Returns (left, right)
+*/
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename GoesLeft>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::splitHelper(Node* node, GoesLeft& goesLeft) -> std::pair<Node*, Node*> {
+    if(!node)   //base case: nothing left to split
+        return std::pair<Node*, Node*>(nullptr, nullptr);
+    Node* left = node->left;
+    Node* right = node->right;
+    if(goesLeft(node)) {    //node and its left subtree stay left, the cut is somewhere in the right subtree
+        std::pair<Node*, Node*> parts = splitHelper(right, goesLeft);
+        return std::pair<Node*, Node*>(joinHelper(left, node, parts.first), parts.second);
+    }
+    std::pair<Node*, Node*> parts = splitHelper(left, goesLeft);
+    return std::pair<Node*, Node*>(parts.first, joinHelper(parts.second, node, right));
+}
+
+/*  Joins two balanced subtrees with mid between them (everything in left before mid, mid before everything in right).
+    Walks down the taller side's inner spine to a subtree about as tall as the other side, hangs mid there and
+    rebalances back up, so it is O(height difference + 1).  Returns the new top
+*/
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::joinHelper(Node* left, Node* mid, Node* right) -> Node* {
+    if(height(left) > height(right) + 1) {  //left is taller, mid and right go down its right spine
+        left = writable(left);
+        left->right = joinHelper(left->right, mid, right);
+        return doBalance(left);
+    }
+    if(height(right) > height(left) + 1) {  //right is taller, down its left spine
+        right = writable(right);
+        right->left = joinHelper(left, mid, right->left);
+        return doBalance(right);
+    }
+    mid = writable(mid);    //heights within one of each other, mid can sit on top
+    mid->left = left;
+    mid->right = right;
+    updateHeight(mid);
+    return mid;
+}
+
+//joinHelper() without a middle entry: right's first entry is taken out to be the middle.  Either side may be empty
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::concatHelper(Node* left, Node* right) -> Node* {
+    if(!left)
+        return right;
+    if(!right)
+        return left;
+    Node* first;
+    right = removeFirst(right, first);
+    return joinHelper(left, first, right);
+}
+
+//Unlinks the first entry of the subtree at node (which must exist) into first, returning the rebalanced rest
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::removeFirst(Node* node, Node*& first) -> Node* {
+    if(!node->left) {   //base case: node is the first entry, its right subtree takes its place
+        first = node;
+        return node->right;
+    }
+    node = writable(node);
+    node->left = removeFirst(node->left, first);
+    return doBalance(node);
+}
+
+//Splits the entries with start <= key <= end out of the tree and joins the rest back together as the new root.
+//Returns the detached subtree, nullptr if the range is empty
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::cutRange(const Key& start, const Key& end) -> Node* {
+    if(less(end, start))
+        return nullptr;
+    auto belowStart = [this, &start](Node* n) { return less(Traits::key(n), start); };
+    auto uptoEnd = [this, &end](Node* n) { return !less(end, Traits::key(n)); };
+    std::pair<Node*, Node*> low = splitHelper(root, belowStart);
+    std::pair<Node*, Node*> high = splitHelper(low.second, uptoEnd);
+    root = concatHelper(low.first, high.second);
+    return high.first;
+}
+
+//Both subtrees' entries as one subtree, a's first among equal entries.  Joins in O(log n) when one side lies entirely
+//before the other, which is what range moves and merges of adjacent ranges produce, and takes the union otherwise
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::combine(Node* a, Node* b) -> Node* {
+    if(!a)
+        return b;
+    if(!b)
+        return a;
+    Node* firstA = a;
+    Node* lastA = a;
+    Node* firstB = b;
+    Node* lastB = b;
+    while(firstA->left)
+        firstA = firstA->left;
+    while(lastA->right)
+        lastA = lastA->right;
+    while(firstB->left)
+        firstB = firstB->left;
+    while(lastB->right)
+        lastB = lastB->right;
+    if(!before(Traits::key(firstB), Traits::ref(firstB), Traits::key(lastA), Traits::ref(lastA)))   //a, then b
+        return concatHelper(a, b);
+    if(before(Traits::key(lastB), Traits::ref(lastB), Traits::key(firstA), Traits::ref(firstA)))    //b, then a
+        return concatHelper(b, a);
+    return unionHelper(a, b);
+}
+
+//Overlapping case of combine(): splits a around b's root, unions the halves with b's subtrees and joins them back
+//under b's root, O(m log(n/m + 1)) for m = the smaller side
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::unionHelper(Node* a, Node* b) -> Node* {
+    if(!a)
+        return b;
+    if(!b)
+        return a;
+    Node* bLeft = b->left;
+    Node* bRight = b->right;
+    auto notAfter = [this, b](Node* n) {  //a's entries equal to b's root go before it
+        return !before(Traits::key(b), Traits::ref(b), Traits::key(n), Traits::ref(n));
+    };
+    std::pair<Node*, Node*> parts = splitHelper(a, notAfter);
+    Node* left = unionHelper(parts.first, bLeft);
+    Node* right = unionHelper(parts.second, bRight);
+    return joinHelper(left, b, right);
+}
+
+//Copies the subtree at node (from another tree) into this tree's pool as it is, shape, heights and summaries included.
+//Pre-order, so the copy is laid out contiguously like buildHelper()'s
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::cloneHelper(Node* node) -> Node* {
+    if(!node)
+        return nullptr;
+    Node* copy = pool.allocate(*node);
+    copy->version = writeVersion;
+    copy->left = cloneHelper(node->left);
+    copy->right = cloneHelper(node->right);
+    return copy;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::eraseRange(const Key& start, const Key& end) {
+    WriteScope scope(*this);
+    Node* cut = cutRange(start, end);
+    int removed = size(cut);
+    deleteAllHelper(cut);
+    return removed;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::eraseRange(const Key& start, const Key& end, Visitor visit) {
+    WriteScope scope(*this);
+    Node* cut = cutRange(start, end);
+    int removed = size(cut);
+    eraseAllHelper(cut, visit);
+    return removed;
+}
+
+//Every tree allocates from its own pool, so the cut subtree is copied into out's pool and freed here.  Intrusive
+//nodes belong to the caller and move over as they are
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::extractRange(const Key& start, const Key& end, AVLTree& out) {
+    if(&out == this)
+        return 0;
+    WriteScope scope(*this);
+    WriteScope outScope(out);
+    Node* cut = cutRange(start, end);
+    int moved = size(cut);
+    if constexpr(!intrusive) {
+        Node* copy = out.cloneHelper(cut);
+        deleteAllHelper(cut);
+        cut = copy;
+    }
+    out.root = out.combine(out.root, cut);
+    return moved;
+}
+
+//other's slabs (and with them its nodes) become this tree's, so no entry is copied.  Nodes and payloads other retired
+//for its snapshots are freed first, which is why nothing may still be reading other.  Snapshots of this tree are fine
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::join(AVLTree& other) {
+    if(&other == this)
+        return;
+    WriteScope scope(*this);
+    WriteScope otherScope(other);
+    Node* moved = other.root;
+    other.root = nullptr;
+    if constexpr(!intrusive) {
+        for(auto& entry : other.retired)
+            other.pool.release(entry.second);
+        other.retired.clear();
+        pool.absorb(other.pool);
+    }
+    for(auto& entry : other.retiredPayloads)
+        entry.second();
+    other.retiredPayloads.clear();
+    //moved nodes carry other's version stamps, which this tree's later writes could reuse and then modify or free
+    //them in place under a snapshot.  Starting past both histories makes every one of them copied on first write
+    writeVersion = std::max(writeVersion, other.writeVersion) + 1;
+    root = combine(root, moved);
+}
+
+//Builds a perfectly balanced subtree from n entries sorted by key: middle entry becomes the root, halves recurse.
+//Nodes are allocated in pre-order, so a fresh pool lays the tree out contiguously
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::buildHelper(const entry_type* entries, int n) -> Node* {
+    if(n <= 0)  //base case: empty range
+        return nullptr;
+    int mid = n / 2;
+    Node* node = newNode(entries[mid]);
+    node->left = buildHelper(entries, mid);
+    node->right = buildHelper(entries + mid + 1, n - mid - 1);
+    updateHeight(node); //children are done, fix height and size post-order
+    return node;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::buildSorted(const std::vector<entry_type>& sorted) {
+    WriteScope scope(*this);
+    deleteAll();
+    root = buildHelper(sorted.data(), sorted.size());
+}
+
+//Merges sorted into the existing entries (existing ones first on equal keys, same as inserting them one at a time) and rebuilds
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::mergeSorted(const std::vector<entry_type>& sorted) {
+    WriteScope scope(*this);
+    std::vector<entry_type> existing, merged;
+    existing.reserve(size(root));
+    entriesHelper(root, existing);  //writer's own view, not a snapshot
+    merged.reserve(existing.size() + sorted.size());
+    std::merge(existing.begin(), existing.end(), sorted.begin(), sorted.end(), std::back_inserter(merged),
+               [this](const entry_type& a, const entry_type& b) {
+                   return before(Traits::entryKey(a), Traits::entryRef(a), Traits::entryKey(b), Traits::entryRef(b));
+               });
+    buildSorted(merged);
+}
+
+//Rebuilding costs O(n + m), inserting one by one O(m log(n + m)); rebuild once the batch is big enough to pay for it
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::insertBatch(const std::vector<entry_type>& sorted) {
+    WriteScope scope(*this);
+    double n = size(root), m = sorted.size();
+    if(m * std::log2(n + m + 1) >= n + m)
+        mergeSorted(sorted);
+    else {
+        for(auto& e : sorted)
+            linkNode(newNode(e));
+    }
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::inorderTraversal() const -> std::vector<value_type> {
+    return snapshot().inorderTraversal();
+}
+
+//Recursive helper function that lets public function access private root.  Appends to out so the whole traversal shares one vector
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::iotHelper(Node* a, std::vector<value_type>& out) const {
+    if(!a)  //base case 1: a is nullptr, also happens when root is nullptr
+        return; //nothing to append
+
+    //else recursive case 2: a exists, then propagate recursively down left and right sides (in in-order traversal)
+    iotHelper(a->left, out);    //first append left side
+    out.push_back(Traits::get(a));  //second add a's value to output vector
+    iotHelper(a->right, out);   //third append right side
+}
+
+//Same walk as iotHelper() but collects whole entries, for rebuilding
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::entriesHelper(Node* a, std::vector<entry_type>& out) const {
+    if(!a)
+        return;
+    entriesHelper(a->left, out);
+    out.push_back(Traits::entry(a));
+    entriesHelper(a->right, out);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::rangeQuery(const Key& start, const Key& end) const -> std::vector<value_type> {
+    return snapshot().rangeQuery(start, end);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::rangeQuery(const Key& start, const Key& end, std::vector<value_type>& out) const {
+    snapshot().rangeQuery(start, end, out);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+bool AVLTree<Key, Value, Compare, Aggregate, Tie>::rangeQuery(const Key& start, const Key& end, Visitor visit) const {
+    Snapshot snap = snapshot();
+    return snap.rangeQuery(start, end, visit);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::findBatch(const std::vector<Key>& keys, Visitor visit) const {
+    Snapshot snap = snapshot();
+    snap.findBatch(keys, visit);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Match, typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::findBatch(const std::vector<Key>& keys, const std::vector<Match>& matches, Visitor visit) const {
+    Snapshot snap = snapshot();
+    snap.findBatch(keys, matches, visit);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::rangeQueryBatch(const std::vector<std::pair<Key, Key>>& ranges, Visitor visit) const {
+    Snapshot snap = snapshot();
+    snap.rangeQueryBatch(ranges, visit);
+}
+
+/*  Recursive helper for findBatch.  order[lo, hi) are probe indices sorted by key that may still match inside node's
+    subtree.  They split around node's key into those below it, equal to it and above it: the lower and equal ones go
+    on into the left subtree, the equal and higher ones into the right (equal keys can sit on either side after
+    rotations), so the upper levels are read once for the whole batch.  Once few enough probes share a subtree their
+    paths rarely meet again, so they finish as interleaved descents in findGroup() instead.
+*/
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::findBatchHelper(Node* node, const std::vector<Key>& keys, const int* order,
+                                                              int lo, int hi, Visitor& visit) const {
+    if(!node || lo == hi)   //base case: empty subtree or no probes left for it
+        return;
+    if(hi - lo <= BATCH_GROUP) {
+        findGroup(node, keys, order, lo, hi, visit);
+        return;
+    }
+    AVL_STAT(avlStatBump(counters.searchNodesVisited));
+    const Key& k = Traits::key(node);
+    int mid = std::partition_point(order + lo, order + hi, [&](int i) { return less(keys[i], k); }) - order;
+    int up = std::partition_point(order + mid, order + hi, [&](int i) { return !less(k, keys[i]); }) - order;
+    if(lo < up && node->left)
+        __builtin_prefetch(node->left);
+    if(mid < hi && node->right)
+        __builtin_prefetch(node->right);
+    findBatchHelper(node->left, keys, order, lo, up, visit);
+    for(int i = mid; i < up; i++)
+        visit(order[i], Traits::get(node));
+    findBatchHelper(node->right, keys, order, mid, hi, visit);
+}
+
+//Walks the probes order[lo, hi) (at most BATCH_GROUP) down from node in lockstep, one level each per round, prefetching
+//every probe's next node so the misses of the whole group are in flight together instead of one after another
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::findGroup(Node* node, const std::vector<Key>& keys, const int* order,
+                                                        int lo, int hi, Visitor& visit) const {
+    Node* curr[BATCH_GROUP];
+    int live = hi - lo;
+    for(int g = 0; g < live; g++)
+        curr[g] = node;
+    for(int left = live; left > 0;) {
+        for(int g = 0; g < live; g++) {
+            Node* c = curr[g];
+            if(!c)  //this probe is done
+                continue;
+            AVL_STAT(avlStatBump(counters.searchNodesVisited));
+            const Key& probe = keys[order[lo + g]];
+            Node* next;
+            if(less(probe, Traits::key(c)))
+                next = c->left;
+            else if(less(Traits::key(c), probe))
+                next = c->right;
+            else {  //first equal key, the rest of them are below c on either side
+                equalHelper(c, probe, order[lo + g], visit);
+                next = nullptr;
+            }
+            if(next)
+                __builtin_prefetch(next);
+            else
+                left--;
+            curr[g] = next;
+        }
+    }
+}
+
+//Recursive helper for the batch reads: visits every entry with key equal to key in node's subtree, in order
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::equalHelper(Node* node, const Key& key, int probe, Visitor& visit) const {
+    while(node) {
+        if(less(key, Traits::key(node)))
+            node = node->left;
+        else if(less(Traits::key(node), key))
+            node = node->right;
+        else {
+            equalHelper(node->left, key, probe, visit);
+            visit(probe, Traits::get(node));
+            node = node->right; //the right side continues the loop instead of recursing
+        }
+    }
+}
+
+//findGroup() for probes with a Match each: probe g is done at the entry locate() would find for (keys[g], matches[g]).
+//A probe match descends by (key, Tie) in lockstep with the others; any other Match falls back to locate() on its own
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Match, typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::matchGroup(Node* node, const std::vector<Key>& keys, const std::vector<Match>& matches,
+                                                         int lo, int hi, Visitor& visit) const {
+    if constexpr(!PROBE<Match>) {
+        for(int i = lo; i < hi; i++) {
+            Node* path[iterator::MAX_DEPTH];
+            int depth = 0;
+            Match match = matches[i];
+            if(Node* found = locate(node, keys[i], match, path, depth))
+                visit(i, Traits::get(found));
+        }
+    } else {
+        Node* curr[BATCH_GROUP];
+        int live = hi - lo;
+        for(int g = 0; g < live; g++)
+            curr[g] = node;
+        for(int left = node ? live : 0; left > 0;) {    //an empty tree matches nothing
+            for(int g = 0; g < live; g++) {
+                Node* c = curr[g];
+                if(!c)  //this probe is done
+                    continue;
+                AVL_STAT(avlStatBump(counters.searchNodesVisited));
+                const Key& key = keys[lo + g];
+                const Match& match = matches[lo + g];
+                const Key& k = Traits::key(c);
+                Node* next;
+                if(less(key, k) || (!less(k, key) && tie(match, Traits::ref(c))))
+                    next = c->left;
+                else if(less(k, key) || tie(Traits::ref(c), match))
+                    next = c->right;
+                else {  //same key, same Tie position
+                    visit(lo + g, Traits::get(c));
+                    next = nullptr;
+                }
+                if(next)
+                    __builtin_prefetch(next);
+                else
+                    left--;
+                curr[g] = next;
+            }
+        }
+    }
+}
+
+//boundHelper() for n <= BATCH_GROUP keys at once: out[g] becomes the first entry with key >= keyAt(g).  The descents
+//advance in lockstep with each next node prefetched, like findGroup()
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename KeyAt>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::boundGroup(Node* r, int n, KeyAt keyAt, iterator* out) const {
+    Node* curr[BATCH_GROUP];
+    int found[BATCH_GROUP];
+    for(int g = 0; g < n; g++) {
+        out[g] = iterator(r);
+        curr[g] = r;
+        found[g] = 0;
+    }
+    for(int left = r ? n : 0; left > 0;) {  //an empty tree leaves every out[g] at end()
+        for(int g = 0; g < n; g++) {
+            Node* c = curr[g];
+            if(!c)
+                continue;
+            iterator& it = out[g];
+            it.path[it.depth++] = c;
+            Node* next;
+            if(!less(Traits::key(c), keyAt(g))) {   //c is a candidate, look for a smaller one on the left
+                found[g] = it.depth;
+                next = c->left;
+            } else
+                next = c->right;
+            if(next)
+                __builtin_prefetch(next);
+            else {
+                it.depth = found[g];
+                left--;
+            }
+            curr[g] = next;
+        }
+    }
+}
+
+//Recursive helper function that lets public function access private root
+//basically copied from iotHelper() and modified to only work in given range
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::rangeQueryHelper(Node* a, const Key& start, const Key& end, std::vector<value_type>& out) const {
+    if(!a)  //base case 1: a is nullptr
+        return; //nothing to append
+    AVL_STAT(avlStatBump(counters.rangeNodesVisited));
+
+    //recursive case 2: a exists, then rangequery further down either, both, or neither path as necessary
+    if(!less(Traits::key(a), start))   //equal keys can be on either side, so the left side can hold start itself
+        rangeQueryHelper(a->left, start, end, out);    //first append left side
+
+    if(!less(Traits::key(a), start) && !less(end, Traits::key(a)))
+        out.push_back(Traits::get(a));  //second add a's value to output vector (if a's key falls within range)
+
+    if(!less(end, Traits::key(a)))
+        rangeQueryHelper(a->right, start, end, out);   //third append right side
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::begin() const -> iterator {
+    return beginHelper(root);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::end() const -> iterator {
+    return endHelper(root);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::lower_bound(const Key& value) const -> iterator {
+    return boundHelper(root, value, false);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::upper_bound(const Key& value) const -> iterator {
+    return boundHelper(root, value, true);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::beginHelper(Node* r) const -> iterator {
+    iterator it(r);
+    it.pushLeftmost(r);
+    return it;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::endHelper(Node* r) const -> iterator {
+    return iterator(r); //empty path, but remembers the root so --end() works
+}
+
+//First entry with key >= value, or > value if strict.  Walks one root-to-leaf path; the answer is always on that
+//path, so the iterator's stack is just the path cut at the answer
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::boundHelper(Node* r, const Key& value, bool strict) const -> iterator {
+    iterator it(r);
+    int found = 0;  //depth of the best candidate so far, 0 = none (end())
+    Node* curr = r;
+    while(curr) {
+        it.path[it.depth++] = curr;
+        if(strict ? less(value, Traits::key(curr)) : !less(Traits::key(curr), value)) {  //curr is a candidate, look for a smaller one on the left
+            found = it.depth;
+            curr = curr->left;
+        } else
+            curr = curr->right;
+    }
+    it.depth = found;
+    return it;
+}
+
+template<typename Traits>
+AVLIterator<Traits>::AVLIterator() : root(nullptr), depth(0) {}
+
+template<typename Traits>
+AVLIterator<Traits>::AVLIterator(Node* r) : root(r), depth(0) {}
+
+template<typename Traits>
+void AVLIterator<Traits>::pushLeftmost(Node* node) {
+    while(node) {
+        path[depth++] = node;
+        node = node->left;
+    }
+}
+
+template<typename Traits>
+void AVLIterator<Traits>::pushRightmost(Node* node) {
+    while(node) {
+        path[depth++] = node;
+        node = node->right;
+    }
+}
+
+template<typename Traits>
+auto AVLIterator<Traits>::operator*() const -> reference {
+    return Traits::ref(path[depth - 1]);
+}
+
+template<typename Traits>
+auto AVLIterator<Traits>::operator->() const -> pointer {
+    return &Traits::ref(path[depth - 1]);
+}
+
+//Successor: leftmost node of the right subtree if there is one, else the nearest ancestor we reached from its left side
+template<typename Traits>
+AVLIterator<Traits>& AVLIterator<Traits>::operator++() {
+    Node* curr = path[depth - 1];
+    if(curr->right)
+        pushLeftmost(curr->right);
+    else {
+        Node* child = path[--depth];
+        while(depth > 0 && path[depth - 1]->right == child)    //climb while coming up from a right child
+            child = path[--depth];
+    }
+    return *this;
+}
+
+template<typename Traits>
+AVLIterator<Traits> AVLIterator<Traits>::operator++(int) {
+    AVLIterator old = *this;
+    ++*this;
+    return old;
+}
+
+//Predecessor, mirror image of operator++.  From end() it steps onto the last entry
+template<typename Traits>
+AVLIterator<Traits>& AVLIterator<Traits>::operator--() {
+    if(depth == 0) {
+        pushRightmost(root);
+        return *this;
+    }
+    Node* curr = path[depth - 1];
+    if(curr->left)
+        pushRightmost(curr->left);
+    else {
+        Node* child = path[--depth];
+        while(depth > 0 && path[depth - 1]->left == child)  //climb while coming up from a left child
+            child = path[--depth];
+    }
+    return *this;
+}
+
+template<typename Traits>
+AVLIterator<Traits> AVLIterator<Traits>::operator--(int) {
+    AVLIterator old = *this;
+    --*this;
+    return old;
+}
+
+template<typename Traits>
+bool AVLIterator<Traits>::operator==(const AVLIterator& other) const {
+    if(depth == 0 || other.depth == 0)
+        return depth == other.depth;
+    return path[depth - 1] == other.path[other.depth - 1];
+}
+
+template<typename Traits>
+bool AVLIterator<Traits>::operator!=(const AVLIterator& other) const {
+    return !(*this == other);
+}
+
+//Returns a vector with k elements, of the k nearest entries to key
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::findKNearestKeys(const Key& key, int k) const -> std::vector<value_type> {
+    return snapshot().findKNearestKeys(key, k);
+}
+
+//Same as findKNearestKeys() but never returns an entry further than radius from key (so may return fewer than k)
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::findKNearestKeysWithin(const Key& key, int k, distance_type radius) const -> std::vector<value_type> {
+    return snapshot().findKNearestKeysWithin(key, k, radius);
+}
+
+//Two-cursor walk outward from key: below starts at the last entry < key and steps back, above starts at the first entry > key
+//and steps forward, taking whichever is closer each time (below wins ties).  Entries equal to key are skipped.  Below and
+//above are in Compare's order, numerically the other way round under e.g. std::greater
+//O(log n + k) instead of materializing the whole tree.  radius == nullptr means unbounded
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::nearestHelper(Node* r, const Key& key, int k, const distance_type* radius) const -> std::vector<value_type> {
+    static_assert(AVLKeyDistance<Key>::defined, "nearest-key queries need arithmetic keys");
+    using Distance = AVLKeyDistance<Key>;
+    std::vector<value_type> out = {};
+    if(k <= 0)
+        return out;
+    out.reserve(k < size(r) ? k : size(r));
+
+    iterator first = beginHelper(r), last = endHelper(r);
+    iterator below = boundHelper(r, key, false), above = boundHelper(r, key, true);
+    bool hasBelow = below != first;
+    if(hasBelow)
+        --below;    //step from the first entry >= key to the last entry < key
+    bool hasAbove = above != last;
+
+    while(k > 0 && (hasBelow || hasAbove)) {
+        distance_type belowDist{}, aboveDist{};
+        if(hasBelow)
+            belowDist = Distance::between(below.key(), key);
+        if(hasAbove)
+            aboveDist = Distance::between(key, above.key());
+        if(hasAbove && (!hasBelow || aboveDist < belowDist)) {  //above is strictly closer
+            if(radius && aboveDist > *radius)
+                break;
+            out.push_back(Traits::get(above.node()));
+            ++above;
+            hasAbove = above != last;
+        } else {
+            if(radius && belowDist > *radius)
+                break;
+            out.push_back(Traits::get(below.node()));
+            hasBelow = below != first;
+            if(hasBelow)
+                --below;
+        }
+        k--;    //remember to count only k entries
+    }
+
+    std::reverse(out.begin(), out.end());   //db_driver wants vector of records in reverse order of pushed order
+    return out;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::count() const {
+    return snapshot().count();
+}
+
+//Counts entries with key < value (or <= value if inclusive) by walking a single root-to-leaf path
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::countBelow(Node* r, const Key& value, bool inclusive) const {
+    int out = 0;
+    Node* curr = r;
+    while(curr) {
+        if(inclusive ? !less(value, Traits::key(curr)) : less(Traits::key(curr), value)) { //curr and its whole left subtree are below
+            out += size(curr->left) + 1;
+            curr = curr->right;
+        } else
+            curr = curr->left;
+    }
+    return out;
+}
+
+//Number of entries with key strictly less than value, i.e. the index value would be inserted at
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::rank(const Key& value) const {
+    return snapshot().rank(value);
+}
+
+//Returns the entry at 0-based position i of the in-order traversal, nullptr if i is out of range
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::select(int i) const -> pointer {
+    return snapshot().select(i);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::selectHelper(Node* r, int i) const -> pointer {
+    if(i < 0 || i >= size(r))
+        return nullptr;
+    Node* curr = r;
+    while(curr) {
+        int leftSize = size(curr->left);
+        if(i < leftSize)    //target is in left subtree
+            curr = curr->left;
+        else if(i == leftSize)  //target is curr itself
+            return Traits::ptr(curr);
+        else {  //target is in right subtree, skip left subtree and curr
+            i -= leftSize + 1;
+            curr = curr->right;
+        }
+    }
+    return nullptr;
+}
+
+//Number of entries with start <= key <= end, same bounds as rangeQuery()
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::countInRange(const Key& start, const Key& end) const {
+    return snapshot().countInRange(start, end);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::aggregateRange(const Key& start, const Key& end) const -> aggregate_type {
+    return snapshot().aggregateRange(start, end);
+}
+
+/*  Recursive helper for aggregateRange.  checkStart/checkEnd say whether node's subtree may still hold keys below
+    start/above end; once neither can, the whole subtree is taken from its summary, so only the two boundary paths
+    are walked.  acc collects the summaries in key order.
+*/
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::aggregateHelper(Node* node, const Key& start, const Key& end,
+                                                              bool checkStart, bool checkEnd, aggregate_type& acc) const {
+    if(!node)   //base case: empty subtree
+        return;
+    auto add = [&acc](const summary_type& s, int n) {
+        acc.summary = acc.count ? Aggregate::combine(acc.summary, s) : s;
+        acc.count += n;
+    };
+    if(!checkStart && !checkEnd) {  //subtree lies inside the range
+        add(node->summary, node->size);
+        return;
+    }
+    const Key& k = node->key;
+    bool aboveStart = !checkStart || !less(k, start);
+    bool belowEnd = !checkEnd || !less(end, k);
+    if(aboveStart)  //left subtree can only hold keys in range if node isn't below start
+        aggregateHelper(node->left, start, end, checkStart, checkEnd && less(end, k), acc);
+    if(aboveStart && belowEnd)
+        add(Aggregate::of(k, node->value), 1);
+    if(belowEnd)
+        aggregateHelper(node->right, start, end, checkStart && less(k, start), checkEnd, acc);
+}
+
+//Snapshot reads run the tree's helpers against the pinned root
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Match>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::find(const Key& key, Match match) const -> pointer {
+    AVL_STAT(avlStatBump(tree->counters.searches));
+    return tree->findHelper(root, key, match);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::find(const Key& key) const -> pointer {
+    return find(key, [](typename Traits::reference) { return true; });
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::inorderTraversal() const -> std::vector<value_type> {
+    std::vector<value_type> out;
+    out.reserve(count());   //size is known up front, so the traversal never reallocates
+    tree->iotHelper(root, out);
+    return out;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::rangeQuery(const Key& start, const Key& end) const -> std::vector<value_type> {
+    std::vector<value_type> out;
+    rangeQuery(start, end, out);
+    return out;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::rangeQuery(const Key& start, const Key& end, std::vector<value_type>& out) const {
+    AVL_STAT(avlStatBump(tree->counters.rangeQueries));
+    int n = countInRange(start, end);   //O(log n) exact result size, reserve once
+    out.reserve(out.size() + n);
+    tree->rangeQueryHelper(root, start, end, out);
+}
+
+//Streams the entries of [start, end] to visit without building any vector.  Returns false if visit stopped the scan early
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+bool AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::rangeQuery(const Key& start, const Key& end, Visitor visit) const {
+    AVL_STAT(avlStatBump(tree->counters.rangeQueries));
+    for(iterator it = lower_bound(start), last = this->end(); it != last && !tree->less(end, it.key()); ++it) {
+        AVL_STAT(avlStatBump(tree->counters.rangeNodesVisited));
+        if(!visit(Traits::get(it.node())))
+            return false;
+    }
+    return true;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::findKNearestKeys(const Key& key, int k) const -> std::vector<value_type> {
+    return tree->nearestHelper(root, key, k, nullptr);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::findKNearestKeysWithin(const Key& key, int k, distance_type radius) const -> std::vector<value_type> {
+    if constexpr(std::is_floating_point_v<distance_type>) {
+        if(radius < 0)
+            return {};
+    }
+    return tree->nearestHelper(root, key, k, &radius);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::count() const {
+    return tree->size(root);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::rank(const Key& value) const {
+    return tree->countBelow(root, value, false);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::select(int i) const -> pointer {
+    return tree->selectHelper(root, i);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::countInRange(const Key& start, const Key& end) const {
+    if(tree->less(end, start))
+        return 0;
+    return tree->countBelow(root, end, true) - tree->countBelow(root, start, false);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::aggregateRange(const Key& start, const Key& end) const -> aggregate_type {
+    static_assert(AGGREGATED, "aggregateRange() needs a tree with an Aggregate");
+    aggregate_type acc;
+    if(!tree->less(end, start))
+        tree->aggregateHelper(root, start, end, true, true, acc);
+    return acc;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::findBatch(const std::vector<Key>& keys, Visitor visit) const {
+    AVL_STAT(avlStatBump(tree->counters.searches, keys.size()));
+    std::vector<int> order(keys.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [this, &keys](int a, int b) { return tree->less(keys[a], keys[b]); });
+    tree->findBatchHelper(root, keys, order.data(), 0, order.size(), visit);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Match, typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::findBatch(const std::vector<Key>& keys, const std::vector<Match>& matches, Visitor visit) const {
+    AVL_STAT(avlStatBump(tree->counters.searches, keys.size()));
+    int n = keys.size();
+    for(int lo = 0; lo < n; lo += BATCH_GROUP)
+        tree->matchGroup(root, keys, matches, lo, std::min(n, lo + BATCH_GROUP), visit);
+}
+
+/*  Sweeps the union of the ranges once, in key order.  Ranges join the active set when the sweep reaches their start
+    and leave it once it passes their end, and every entry is handed to each active range.  The sweep only descends
+    from the root again to skip a gap that no range covers, so overlapping and adjacent ranges never rescan or
+    re-descend.  Those descents are worked out BATCH_GROUP upcoming starts at a time by boundGroup().
+*/
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+template<typename Visitor>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::rangeQueryBatch(const std::vector<std::pair<Key, Key>>& ranges, Visitor visit) const {
+    AVL_STAT(avlStatBump(tree->counters.rangeQueries, ranges.size()));
+    std::vector<int> order;
+    order.reserve(ranges.size());
+    for(int i = 0, n = ranges.size(); i < n; i++) {
+        if(!tree->less(ranges[i].second, ranges[i].first))  //empty ranges never match anything
+            order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [this, &ranges](int a, int b) { return tree->less(ranges[a].first, ranges[b].first); });
+
+    std::vector<int> active;    //ranges whose start the sweep has passed and whose end it hasn't
+    size_t next = 0;    //first range of order not yet active
+    iterator it = end(), last = end();
+    iterator seeks[BATCH_GROUP];    //lower_bound() of the starts of order[seekFrom, seekFrom + seekCount)
+    size_t seekFrom = 0, seekCount = 0;
+    while(next < order.size() || !active.empty()) {
+        if(active.empty() && (it == last || tree->less(it.key(), ranges[order[next]].first))) {
+            //nothing covers the entries before the next start, skip them
+            if(next >= seekFrom + seekCount) {
+                seekFrom = next;
+                seekCount = std::min<size_t>(BATCH_GROUP, order.size() - next);
+                tree->boundGroup(root, seekCount, [&](int g) -> const Key& { return ranges[order[seekFrom + g]].first; }, seeks);
+            }
+            it = seeks[next - seekFrom];
+        }
+        if(it == last)
+            break;
+        const Key& k = it.key();
+        while(next < order.size() && !tree->less(k, ranges[order[next]].first))
+            active.push_back(order[next++]);
+        for(size_t j = 0; j < active.size();) {
+            if(tree->less(ranges[active[j]].second, k)) {   //sweep is past this range's end
+                active[j] = active.back();
+                active.pop_back();
+            } else {
+                AVL_STAT(avlStatBump(tree->counters.rangeNodesVisited));
+                visit(active[j++], Traits::get(it.node()));
+            }
+        }
+        ++it;
+    }
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::begin() const -> iterator {
+    return tree->beginHelper(root);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::end() const -> iterator {
+    return tree->endHelper(root);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::lower_bound(const Key& value) const -> iterator {
+    return tree->boundHelper(root, value, false);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+auto AVLTree<Key, Value, Compare, Aggregate, Tie>::Snapshot::upper_bound(const Key& value) const -> iterator {
+    return tree->boundHelper(root, value, true);
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+AVLTreeStats AVLTree<Key, Value, Compare, Aggregate, Tie>::stats() const {
+    AVLTreeStats out;
+    Snapshot snap = snapshot();
+    out.height = height(snap.root);
+    out.size = size(snap.root);
+#ifdef AVL_STATS
+    out.rotationsLeft = counters.rotationsLeft.load();
+    out.rotationsRight = counters.rotationsRight.load();
+    out.searches = counters.searches.load();
+    out.searchNodesVisited = counters.searchNodesVisited.load();
+    out.rangeQueries = counters.rangeQueries.load();
+    out.rangeNodesVisited = counters.rangeNodesVisited.load();
+    pool.addStats(out); //pool counters belong to the writer, approximate if read while one is active
+#endif
+    return out;
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+void AVLTree<Key, Value, Compare, Aggregate, Tie>::resetStats() {
+#ifdef AVL_STATS
+    for(auto c : {&counters.rotationsLeft, &counters.rotationsRight, &counters.searches, &counters.searchNodesVisited,
+                  &counters.rangeQueries, &counters.rangeNodesVisited})
+        c->store(0);
+    pool.resetStats();
+#endif
+}
+
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+bool AVLTree<Key, Value, Compare, Aggregate, Tie>::checkInvariants() const {
+    Snapshot snap = snapshot();
+    const Node* prev = nullptr;
+    bool ok = true;
+    checkHelper(snap.root, prev, ok);
+    return ok;
+}
+
+//Recursive helper for checkInvariants, in-order so prev is the previous node by key.  Returns the real height of
+//the subtree and clears ok on any violation
+template<typename Key, typename Value, typename Compare, typename Aggregate, typename Tie>
+int AVLTree<Key, Value, Compare, Aggregate, Tie>::checkHelper(Node* node, const Node*& prev, bool& ok) const {
+    if(!node)   //base case: empty subtree
+        return 0;
+    int lh = checkHelper(node->left, prev, ok);
+    if(prev && before(Traits::key(node), Traits::ref(node), Traits::key(prev), Traits::ref(prev)))  //order must never decrease
+        ok = false;
+    prev = node;
+    int rh = checkHelper(node->right, prev, ok);
+    int h = (lh > rh ? lh : rh) + 1;
+    if(node->height != h || abs(lh - rh) > 1 || node->size != size(node->left) + size(node->right) + 1)
+        ok = false;
+    if constexpr(AGGREGATED) {  //same combine order as updateSummary(), so floating sums match exactly
+        summary_type s = Aggregate::of(node->key, node->value);
+        if(node->left)
+            s = Aggregate::combine(node->left->summary, s);
+        if(node->right)
+            s = Aggregate::combine(s, node->right->summary);
+        if(!(node->summary == s))
+            ok = false;
+    }
+    return h;
+}
+
+#endif // AVL_TREE_HPP
@@ -0,0 +1,266 @@
+#include "Sharded_Database.hpp"
+#include <algorithm>    //for upper_bound() over the boundaries, reverse() in findKNearestKeys()
+#include <climits>  //for LLONG_MAX in findKNearestKeys(), INT_MIN/INT_MAX in rebalanceLocked()
+
+ThreadPool::ThreadPool(int threads) : stopping(false) {
+    for(int i = 0; i < threads; i++)
+        workers.emplace_back([this] { work(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for(auto& worker : workers)
+        worker.join();
+}
+
+//Worker loop: run tasks until the pool is stopping and the queue is drained
+void ThreadPool::work() {
+    for(;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+            if(tasks.empty())   //stopping with nothing left to do
+                return;
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
+
+//threads == 0 picks one worker per shard, up to the number of cores.  A reversed range is swapped, and a range with
+//fewer values than shards gets one shard per value, so the boundaries always climb strictly
+ShardedDatabase::ShardedDatabase(int shardCount, int minValue, int maxValue, int threads)
+    : total(0), stuckAt(0), pool(threads > 0 ? threads : std::max(1, std::min<int>(shardCount, std::thread::hardware_concurrency()))) {
+    if(maxValue < minValue)
+        std::swap(minValue, maxValue);
+    long long span = (long long)maxValue - minValue + 1;
+    if(shardCount > span)
+        shardCount = span;
+    if(shardCount < 1)
+        shardCount = 1;
+    long long step = span / shardCount;
+    for(int i = 0; i < shardCount; i++) {
+        shards.push_back(std::unique_ptr<Shard>(new Shard()));
+        lower.push_back(i == 0 ? INT_MIN : (int)(minValue + i * step));
+    }
+}
+
+//Index of the shard whose range holds value: the last one whose lower bound is <= value
+int ShardedDatabase::shardFor(int value) const {
+    return std::upper_bound(lower.begin(), lower.end(), value) - lower.begin() - 1;
+}
+
+bool ShardedDatabase::skewed(int shardSize) const {
+    int n = total.load();
+    return shardSize >= MIN_REBALANCE && shardSize > SKEW_FACTOR * (n / (int)shards.size()) && n >= 2 * stuckAt.load();
+}
+
+//Runs fn(i) for every shard in [first, last]: the first on the calling thread, the rest on the pool, and waits for all
+template<typename Fn>
+void ShardedDatabase::fanOut(int first, int last, Fn fn) const {
+    std::vector<std::future<void>> pending;
+    for(int i = first + 1; i <= last; i++)
+        pending.push_back(pool.submit([&fn, i] { fn(i); }));
+    fn(first);
+    for(auto& done : pending)
+        done.get();
+}
+
+void ShardedDatabase::insert(Record* record) {
+    int shardSize;
+    {
+        std::shared_lock<std::shared_mutex> shared(layout);
+        Shard& shard = *shards[shardFor(record->value)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.db.insert(record);
+        shardSize = shard.db.countRecords();
+        total++;
+    }
+    if(skewed(shardSize)) {
+        std::unique_lock<std::shared_mutex> exclusive(layout);
+        int largest = 0;    //another writer may have rebalanced while we waited
+        for(auto& shard : shards)
+            largest = std::max(largest, shard->db.countRecords());
+        if(skewed(largest))
+            rebalanceLocked();
+    }
+}
+
+Record* ShardedDatabase::search(const std::string& key, int value) const {
+    std::shared_lock<std::shared_mutex> shared(layout);
+    Shard& shard = *shards[shardFor(value)];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.db.search(key, value);
+}
+
+Record* ShardedDatabase::find(std::string_view key, int value) const {
+    std::shared_lock<std::shared_mutex> shared(layout);
+    Shard& shard = *shards[shardFor(value)];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.db.find(key, value);
+}
+
+void ShardedDatabase::deleteRecord(const std::string& key, int value) {
+    std::shared_lock<std::shared_mutex> shared(layout);
+    Shard& shard = *shards[shardFor(value)];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    int before = shard.db.countRecords();
+    shard.db.deleteRecord(key, value);
+    total -= before - shard.db.countRecords();
+}
+
+//Each overlapping shard is queried in parallel into its own vector, then the pieces are joined in shard (= value) order
+std::vector<Record*> ShardedDatabase::rangeQuery(int start, int end) const {
+    if(start > end)
+        return {};
+    std::shared_lock<std::shared_mutex> shared(layout);
+    int first = shardFor(start), last = shardFor(end);
+    std::vector<std::vector<Record*>> parts(last - first + 1);
+    fanOut(first, last, [&](int i) {
+        std::lock_guard<std::mutex> guard(shards[i]->lock);
+        shards[i]->db.rangeQuery(start, end, parts[i - first]);
+    });
+    std::vector<Record*> out;
+    size_t n = 0;
+    for(auto& part : parts)
+        n += part.size();
+    out.reserve(n);
+    for(auto& part : parts)
+        out.insert(out.end(), part.begin(), part.end());
+    return out;
+}
+
+std::vector<Record*> ShardedDatabase::inorderTraversal() const {
+    std::shared_lock<std::shared_mutex> shared(layout);
+    std::vector<std::vector<Record*>> parts(shards.size());
+    fanOut(0, shards.size() - 1, [&](int i) {
+        std::lock_guard<std::mutex> guard(shards[i]->lock);
+        parts[i] = shards[i]->db.inorderTraversal();
+    });
+    std::vector<Record*> out;
+    out.reserve(total.load());
+    for(auto& part : parts)
+        out.insert(out.end(), part.begin(), part.end());
+    return out;
+}
+
+/*  Same answer as IndexedDatabase::findKNearestKeys().  Shards partition the values, so the records below key in
+    descending order are the home shard's followed by each lower neighbour's, and likewise upwards; each side collects
+    at most k candidates, visiting neighbours only while it is short.  The two candidate lists are then merged with the
+    same rule as the single tree (closer first, below wins ties, records equal to key skipped)
+*/
+std::vector<Record*> ShardedDatabase::findKNearestKeys(int key, int k) const {
+    if(k <= 0)
+        return {};
+    std::shared_lock<std::shared_mutex> shared(layout);
+    int home = shardFor(key);
+    std::vector<Record*> below, above;
+    for(int i = home; i >= 0 && (int)below.size() < k; i--) {
+        std::lock_guard<std::mutex> guard(shards[i]->lock);
+        const IndexedDatabase& db = shards[i]->db;
+        for(auto it = db.lower_bound(key), first = db.begin(); it != first && (int)below.size() < k; )
+            below.push_back(*--it);
+    }
+    for(int i = home; i < (int)shards.size() && (int)above.size() < k; i++) {
+        std::lock_guard<std::mutex> guard(shards[i]->lock);
+        const IndexedDatabase& db = shards[i]->db;
+        for(auto it = db.upper_bound(key), last = db.end(); it != last && (int)above.size() < k; ++it)
+            above.push_back(*it);
+    }
+
+    std::vector<Record*> out;
+    size_t b = 0, a = 0;
+    while((int)out.size() < k && (b < below.size() || a < above.size())) {
+        long long belowDist = b < below.size() ? (long long)key - below[b]->value : LLONG_MAX;
+        long long aboveDist = a < above.size() ? (long long)above[a]->value - key : LLONG_MAX;
+        if(aboveDist < belowDist)
+            out.push_back(above[a++]);
+        else
+            out.push_back(below[b++]);
+    }
+    std::reverse(out.begin(), out.end());   //same order as IndexedDatabase::findKNearestKeys()
+    return out;
+}
+
+void ShardedDatabase::clearDatabase() {
+    std::unique_lock<std::shared_mutex> exclusive(layout);
+    for(auto& shard : shards)
+        shard->db.clearDatabase();
+    total = 0;
+    stuckAt = 0;
+}
+
+//Each shard's count is O(1), so summing them beats handing them to the pool
+int ShardedDatabase::countRecords() const {
+    std::shared_lock<std::shared_mutex> shared(layout);
+    int n = 0;
+    for(auto& shard : shards) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        n += shard->db.countRecords();
+    }
+    return n;
+}
+
+void ShardedDatabase::rebalance() {
+    std::unique_lock<std::shared_mutex> exclusive(layout);
+    rebalanceLocked();
+}
+
+//Caller holds layout exclusively.  Puts shard i's lower bound at the value i/N of the way through (found by rank, so
+//nothing is collected), then moves each slice whose shard changes with extractRange()/merge().  Neighbouring shards
+//hold neighbouring values, so those merges are O(log n) joins and only the moved records cost anything beyond that.
+//Equal values always land in the same shard
+void ShardedDatabase::rebalanceLocked() {
+    int n = 0, count = shards.size();
+    for(auto& shard : shards)
+        n += shard->db.countRecords();
+    if(n == 0)
+        return;
+    std::vector<int> next(count, INT_MIN);
+    for(int i = 1; i < count; i++) {
+        int rank = (long long)i * n / count;
+        for(auto& shard : shards) {   //the shard holding that rank overall
+            int size = shard->db.countRecords();
+            if(rank < size) {
+                next[i] = shard->db.select(rank)->value;
+                break;
+            }
+            rank -= size;
+        }
+    }
+    if(next != lower) { //repeated values can leave the split where it already is
+        for(int from = 0; from < count; from++) {
+            for(int to = 0; to < count; to++) {
+                long long end = to + 1 == count ? INT_MAX : (long long)next[to + 1] - 1;  //to's new range is [next[to], end]
+                if(to == from || end < next[to] || shards[from]->db.countInRange(next[to], end) == 0)
+                    continue;
+                shards[to]->db.merge(*shards[from]->db.extractRange(next[to], end));
+            }
+        }
+        lower = next;
+    }
+    int largest = 0;
+    for(auto& shard : shards)
+        largest = std::max(largest, shard->db.countRecords());
+    stuckAt = largest > SKEW_FACTOR * (n / count) ? n : 0;
+}
+
+int ShardedDatabase::shardCount() const {
+    return shards.size();
+}
+
+std::vector<int> ShardedDatabase::shardSizes() const {
+    std::shared_lock<std::shared_mutex> shared(layout);
+    std::vector<int> out;
+    for(auto& shard : shards) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        out.push_back(shard->db.countRecords());
+    }
+    return out;
+}
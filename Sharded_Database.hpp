@@ -0,0 +1,103 @@
+#ifndef SHARDED_DATABASE_HPP
+#define SHARDED_DATABASE_HPP
+
+#include "AVL_Database.hpp"
+#include <vector>
+#include <memory>   //for unique_ptr, IndexedDatabase can't be moved
+#include <mutex>    //for the per-shard locks
+#include <shared_mutex> //for the shard layout lock
+#include <thread>   //for the pool's workers
+#include <condition_variable>   //for waking idle workers
+#include <queue>    //for the pool's task queue
+#include <functional>   //for queued tasks
+#include <future>   //for waiting on fanned-out tasks
+#include <atomic>   //for the record count shared by all writers
+#include <climits>  //for INT_MIN/INT_MAX default bounds
+
+//Fixed set of worker threads running queued tasks, used to fan queries out across shards
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+
+    void work();
+
+public:
+    explicit ThreadPool(int threads);
+    ~ThreadPool();  //finishes queued tasks, then joins the workers
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    template<typename Fn>
+    std::future<void> submit(Fn fn);
+};
+
+template<typename Fn>
+std::future<void> ThreadPool::submit(Fn fn) {
+    auto task = std::make_shared<std::packaged_task<void()>>(std::move(fn));
+    std::future<void> done = task->get_future();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push([task] { (*task)(); });
+    }
+    wake.notify_one();
+    return done;
+}
+
+/*  Range-partitioned database: the value space is split into N contiguous ranges, each held by its own IndexedDatabase
+    behind its own mutex, so writes to different shards run in parallel.  Queries that span shards fan out across a
+    thread pool and are stitched back together in value order, so every result matches a single IndexedDatabase.
+    When one shard grows past SKEW_FACTOR times the average, the boundaries are recomputed from the data so every
+    shard holds about the same number of records.  If that still leaves a shard too big (one heavily repeated value no
+    boundary can split), the total has to double before skew is checked again, so such data doesn't rebalance on every
+    insert.  Records belong to the caller, as with IndexedDatabase.
+*/
+class ShardedDatabase {
+private:
+    static const int SKEW_FACTOR = 2;
+    static const int MIN_REBALANCE = 1024;  //records per shard before skew is worth fixing
+
+    struct Shard {
+        IndexedDatabase db;
+        mutable std::mutex lock;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<int> lower; //shard i holds lower[i] <= value < lower[i + 1], lower[0] is INT_MIN
+    mutable std::shared_mutex layout;   //shared by every operation, exclusive while boundaries move
+    std::atomic<int> total;
+    std::atomic<int> stuckAt;   //total when a rebalance last failed to even out the shards, 0 if it succeeded
+    mutable ThreadPool pool;
+
+    int shardFor(int value) const;
+    bool skewed(int shardSize) const;
+    void rebalanceLocked();
+    template<typename Fn>
+    void fanOut(int first, int last, Fn fn) const;
+
+public:
+    //Boundaries start evenly spaced over [minValue, maxValue]; values outside it go to the first/last shard.  There are
+    //never more shards than values in the range
+    explicit ShardedDatabase(int shardCount, int minValue = INT_MIN, int maxValue = INT_MAX, int threads = 0);
+    ShardedDatabase(const ShardedDatabase&) = delete;
+    ShardedDatabase& operator=(const ShardedDatabase&) = delete;
+
+    void insert(Record* record);
+    Record* search(const std::string& key, int value) const;
+    Record* find(std::string_view key, int value) const;    //nullptr on a miss, like IndexedDatabase::find()
+    void deleteRecord(const std::string& key, int value);
+    std::vector<Record*> rangeQuery(int start, int end) const;
+    std::vector<Record*> findKNearestKeys(int key, int k) const;
+    std::vector<Record*> inorderTraversal() const;
+    void clearDatabase();
+    int countRecords() const;
+
+    void rebalance();   //recomputes the boundaries so every shard holds about the same number of records, moving only the records that change shard
+    int shardCount() const;
+    std::vector<int> shardSizes() const;
+};
+
+#endif // SHARDED_DATABASE_HPP
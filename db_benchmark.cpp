@@ -0,0 +1,435 @@
+/*  Benchmark harness for IndexedDatabase.  Build and run like db_driver:
+        g++ -std=c++17 -O2 -o db_benchmark db_benchmark.cpp
+        ./db_benchmark --sizes 1000,100000,1000000 > bench_output.txt
+    Every (workload, size) pair runs in its own forked child, so peak RSS is per run, and prints one JSON object per
+    line: throughput, latency percentiles (ns) and peak RSS (KB).  Compare two builds by diffing their outputs.
+
+    Options (all optional):
+        --sizes n1,n2,...       record counts, default 1000,10000,100000,1000000 (10^7 works, it just takes a while)
+        --workloads w1,w2,...   any of insert_seq, insert_rand, search_hit, search_miss, frozen_hit, frozen_miss,
+                                range_narrow, range_wide, knn, search_batch, range_batch, mixed, clear, expire; default all
+        --ops n                 operations per read/mixed workload, default 100000
+        --k k1,k2,...           k values for knn, default 1,10,100
+        --read-ratio r1,r2,...  fraction of reads in mixed, default 0.5,0.9,0.99
+        --narrow n              records per narrow range query, default 10
+        --wide n                records per wide range query, default 10000
+        --batch n               probes per search_batch/range_batch call, default 256
+        --window n              records per window dropped by expire, default 1000
+        --key-length n          pads record keys to n characters, default 0 (keys like key123)
+        --distinct-keys n       reuses n distinct keys across the records (values stay unique), default 0 = all distinct
+        --seed n                random seed, default 1
+*/
+#include "AVL_Database.hpp"
+#include "AVL_Database.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>   //for getrusage() peak RSS
+#include <sys/wait.h>   //for waitpid() on the per-run child
+#include <unistd.h> //for fork()
+using namespace std;
+
+struct Options {
+    vector<long long> sizes = {1000, 10000, 100000, 1000000};
+    vector<string> workloads = {"insert_seq", "insert_rand", "search_hit", "search_miss", "frozen_hit", "frozen_miss", "range_narrow", "range_wide", "knn", "search_batch", "range_batch", "mixed", "clear", "expire"};
+    long long ops = 100000;
+    vector<long long> ks = {1, 10, 100};
+    vector<double> readRatios = {0.5, 0.9, 0.99};
+    long long narrow = 10;
+    long long wide = 10000;
+    long long batch = 256;
+    long long window = 1000;
+    long long keyLength = 0;
+    long long distinctKeys = 0;
+    unsigned seed = 1;
+};
+
+//Per-operation latencies of one run, reported as percentiles
+class Timer {
+private:
+    vector<long long> samples;  //ns per op
+    chrono::steady_clock::time_point runStart, opStart;
+
+public:
+    void reserve(size_t n) {
+        samples.reserve(n);
+    }
+    void startRun() {
+        runStart = chrono::steady_clock::now();
+    }
+    void startOp() {
+        opStart = chrono::steady_clock::now();
+    }
+    void endOp() {
+        samples.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - opStart).count());
+    }
+    double elapsed() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - runStart).count();
+    }
+    long long percentile(double p) {    //nearest rank, sorts samples on first use
+        if(samples.empty())
+            return 0;
+        if(!is_sorted(samples.begin(), samples.end()))
+            sort(samples.begin(), samples.end());
+        double rank = ceil(p * samples.size() / 100.0);    //smallest sample with at least p% of samples <= it
+        size_t r = rank < 1 ? 0 : static_cast<size_t>(rank) - 1;
+        return samples[r < samples.size() ? r : samples.size() - 1];
+    }
+    size_t count() const {
+        return samples.size();
+    }
+};
+
+static long peakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss; //KB on Linux
+}
+
+static void report(const string& workload, const string& param, long long n, Timer& t, double seconds) {
+    size_t ops = t.count();
+    cout << "{\"workload\":\"" << workload << "\""
+         << ",\"param\":\"" << param << "\""
+         << ",\"records\":" << n
+         << ",\"ops\":" << ops
+         << ",\"seconds\":" << seconds
+         << ",\"ops_per_sec\":" << (seconds > 0 ? ops / seconds : 0)
+         << ",\"p50_ns\":" << t.percentile(50)
+         << ",\"p90_ns\":" << t.percentile(90)
+         << ",\"p99_ns\":" << t.percentile(99)
+         << ",\"p999_ns\":" << t.percentile(99.9)
+         << ",\"max_ns\":" << t.percentile(100)
+         << ",\"peak_rss_kb\":" << peakRssKb()
+         << "}" << endl;
+}
+
+//Records with even values 0, 2, ..., 2(n-1) so odd values are guaranteed misses, in ascending order
+static vector<Record*> makeRecords(long long n, const Options& opt) {
+    vector<Record*> records;
+    records.reserve(n);
+    for(long long i = 0; i < n; i++) {
+        string key = "key" + to_string(opt.distinctKeys > 0 ? i % opt.distinctKeys : i);
+        if((long long)key.size() < opt.keyLength)
+            key.append(opt.keyLength - key.size(), 'x');
+        records.push_back(new Record(key, 2 * i));
+    }
+    return records;
+}
+
+static void runInsert(const string& name, long long n, bool shuffled, const Options& opt) {
+    vector<Record*> records = makeRecords(n, opt);
+    if(shuffled)
+        shuffle(records.begin(), records.end(), mt19937(opt.seed));
+    IndexedDatabase db;
+    Timer t;
+    t.reserve(n);
+    t.startRun();
+    for(auto r : records) {
+        t.startOp();
+        db.insert(r);
+        t.endOp();
+    }
+    report(name, "", n, t, t.elapsed());
+}
+
+//Point lookups, through the tree or (frozen_hit/frozen_miss) through a FrozenIndex of the same records
+static void runSearch(const string& name, long long n, bool hit, bool frozen, const Options& opt) {
+    vector<Record*> records = makeRecords(n, opt);
+    IndexedDatabase db;
+    db.bulkLoad(records, true);
+    FrozenIndex index = frozen ? db.freeze() : FrozenIndex();
+    mt19937 rng(opt.seed);
+    uniform_int_distribution<long long> pick(0, n - 1);
+    Timer t;
+    t.reserve(opt.ops);
+    long long found = 0;
+    t.startRun();
+    for(long long i = 0; i < opt.ops; i++) {
+        Record* r = records[pick(rng)];
+        int value = hit ? r->value : r->value + 1;  //odd values are never stored
+        t.startOp();
+        Record* result = frozen ? index.find(r->key, value) : db.find(r->key, value);
+        t.endOp();
+        found += result ? 1 : 0;
+    }
+    report(name, "found=" + to_string(found), n, t, t.elapsed());
+}
+
+static void runRange(const string& name, long long n, long long width, const Options& opt) {
+    vector<Record*> records = makeRecords(n, opt);
+    IndexedDatabase db;
+    db.bulkLoad(records, true);
+    mt19937 rng(opt.seed);
+    uniform_int_distribution<long long> pick(0, n - 1);
+    vector<Record*> out;
+    Timer t;
+    t.reserve(opt.ops);
+    long long returned = 0;
+    t.startRun();
+    for(long long i = 0; i < opt.ops; i++) {
+        int start = 2 * pick(rng);
+        t.startOp();
+        out = db.rangeQuery(start, start + 2 * (width - 1));   //width records when the range doesn't run off the end
+        t.endOp();
+        returned += out.size();
+    }
+    report(name, "width=" + to_string(width) + ",returned=" + to_string(returned), n, t, t.elapsed());
+}
+
+static void runKnn(long long n, long long k, const Options& opt) {
+    vector<Record*> records = makeRecords(n, opt);
+    IndexedDatabase db;
+    db.bulkLoad(records, true);
+    mt19937 rng(opt.seed);
+    uniform_int_distribution<int> pick(0, 2 * n);
+    Timer t;
+    t.reserve(opt.ops);
+    t.startRun();
+    for(long long i = 0; i < opt.ops; i++) {
+        int key = pick(rng);
+        t.startOp();
+        vector<Record*> out = db.findKNearestKeys(key, k);
+        t.endOp();
+    }
+    report("knn", "k=" + to_string(k), n, t, t.elapsed());
+}
+
+//Same probes as search_hit/range_narrow, issued batch at a time through searchBatch()/rangeQueryBatch().  One op is
+//one batch, so divide ops_per_sec by the batch size to compare against the single-probe workloads
+static void runBatch(const string& name, long long n, bool ranges, const Options& opt) {
+    vector<Record*> records = makeRecords(n, opt);
+    IndexedDatabase db;
+    db.bulkLoad(records, true);
+    mt19937 rng(opt.seed);
+    uniform_int_distribution<long long> pick(0, n - 1);
+    long long batches = (opt.ops + opt.batch - 1) / opt.batch;
+    Timer t;
+    t.reserve(batches);
+    long long returned = 0;
+    t.startRun();
+    for(long long b = 0; b < batches; b++) {
+        if(ranges) {
+            vector<pair<int, int>> probes;
+            for(long long i = 0; i < opt.batch; i++) {
+                int start = 2 * pick(rng);
+                probes.push_back({start, start + 2 * (opt.narrow - 1)});
+            }
+            t.startOp();
+            vector<vector<Record*>> out = db.rangeQueryBatch(probes);
+            t.endOp();
+            for(auto& o : out)
+                returned += o.size();
+        } else {
+            vector<pair<string, int>> probes;
+            for(long long i = 0; i < opt.batch; i++) {
+                Record* r = records[pick(rng)];
+                probes.push_back({r->key, r->value});
+            }
+            t.startOp();
+            vector<Record*> out = db.searchBatch(probes);
+            t.endOp();
+            for(auto r : out)
+                returned += r ? 1 : 0;
+        }
+    }
+    report(name, "batch=" + to_string(opt.batch) + ",returned=" + to_string(returned), n, t, t.elapsed());
+}
+
+//Reads are point hits, writes alternate between inserting a new record and deleting a random present one
+static void runMixed(long long n, double readRatio, const Options& opt) {
+    vector<Record*> records = makeRecords(n, opt);
+    vector<Record*> extra;  //inserted during the run, odd values so they never collide
+    extra.reserve(opt.ops);
+    for(long long i = 0; i < opt.ops; i++)
+        extra.push_back(new Record("extra" + to_string(i), 2 * (i % n) + 1));
+    IndexedDatabase db;
+    db.bulkLoad(records, true);
+    vector<Record*> present = records;
+    mt19937 rng(opt.seed);
+    uniform_real_distribution<double> coin(0, 1);
+    Timer t;
+    t.reserve(opt.ops);
+    long long nextExtra = 0;
+    bool insertNext = true;
+    t.startRun();
+    for(long long i = 0; i < opt.ops; i++) {
+        if(coin(rng) < readRatio || present.empty()) {
+            Record* r = present.empty() ? records[0] : present[rng() % present.size()];
+            t.startOp();
+            db.find(r->key, r->value);
+            t.endOp();
+        } else if(insertNext) {
+            Record* r = extra[nextExtra++];
+            t.startOp();
+            db.insert(r);
+            t.endOp();
+            present.push_back(r);
+            insertNext = false;
+        } else {
+            size_t victim = rng() % present.size();
+            Record* r = present[victim];
+            t.startOp();
+            db.deleteRecord(r->key, r->value);
+            t.endOp();
+            present[victim] = present.back();
+            present.pop_back();
+            insertNext = true;
+        }
+    }
+    ostringstream param;
+    param << "read_ratio=" << readRatio;
+    report("mixed", param.str(), n, t, t.elapsed());
+}
+
+//Window rollover: every op drops the oldest window records, through one deleteRange() or one deleteRecord() each
+static void runExpire(long long n, bool byRange, const Options& opt) {
+    vector<Record*> records = makeRecords(n, opt);
+    IndexedDatabase db;
+    db.bulkLoad(records, true);
+    long long windows = min(opt.ops, n / opt.window);
+    Timer t;
+    t.reserve(windows);
+    t.startRun();
+    for(long long w = 0; w < windows; w++) {
+        long long first = w * opt.window, last = first + opt.window - 1;
+        t.startOp();
+        if(byRange)
+            db.deleteRange(records[first]->value, records[last]->value);
+        else {
+            for(long long i = first; i <= last; i++)
+                db.deleteRecord(records[i]->key, records[i]->value);
+        }
+        t.endOp();
+    }
+    report("expire", "window=" + to_string(opt.window) + (byRange ? ",by=range" : ",by=record"), n, t, t.elapsed());
+}
+
+static void runClear(long long n, const Options& opt) {
+    vector<Record*> records = makeRecords(n, opt);
+    vector<Record*> shuffled = records;
+    shuffle(shuffled.begin(), shuffled.end(), mt19937(opt.seed));
+    IndexedDatabase db;
+    Timer t;
+    double total = 0;
+    for(int rep = 0; rep < 5; rep++) {  //clear is one op per fill, so repeat it
+        for(auto r : shuffled)
+            db.insert(r);
+        t.startRun();
+        t.startOp();
+        db.clearDatabase();
+        t.endOp();
+        total += t.elapsed();
+    }
+    report("clear", "", n, t, total);
+}
+
+//Runs one workload at one size in a forked child so its peak RSS isn't inflated by earlier runs
+template<typename Fn>
+static void isolated(Fn run) {
+    cout.flush();
+    pid_t pid = fork();
+    if(pid == 0) {
+        run();
+        cout.flush();
+        _exit(0);
+    }
+    int status = 0;
+    if(pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        cerr << "Error: benchmark run failed" << endl;
+}
+
+template<typename T>
+static vector<T> parseList(const string& arg) {
+    vector<T> out;
+    stringstream ss(arg);
+    string item;
+    while(getline(ss, item, ',')) {
+        stringstream conv(item);
+        T value;
+        conv >> value;
+        out.push_back(value);
+    }
+    return out;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        string flag = argv[i], value = argv[i + 1];
+        if(flag == "--sizes")
+            opt.sizes = parseList<long long>(value);
+        else if(flag == "--workloads")
+            opt.workloads = parseList<string>(value);
+        else if(flag == "--ops")
+            opt.ops = atoll(value.c_str());
+        else if(flag == "--k")
+            opt.ks = parseList<long long>(value);
+        else if(flag == "--read-ratio")
+            opt.readRatios = parseList<double>(value);
+        else if(flag == "--narrow")
+            opt.narrow = atoll(value.c_str());
+        else if(flag == "--wide")
+            opt.wide = atoll(value.c_str());
+        else if(flag == "--batch")
+            opt.batch = atoll(value.c_str());
+        else if(flag == "--window")
+            opt.window = atoll(value.c_str());
+        else if(flag == "--key-length")
+            opt.keyLength = atoll(value.c_str());
+        else if(flag == "--distinct-keys")
+            opt.distinctKeys = atoll(value.c_str());
+        else if(flag == "--seed")
+            opt.seed = atoi(value.c_str());
+        else {
+            cerr << "Error: unknown option " << flag << endl;
+            return 1;
+        }
+    }
+
+    for(auto n : opt.sizes) {
+        for(auto& w : opt.workloads) {
+            if(w == "insert_seq")
+                isolated([&] { runInsert(w, n, false, opt); });
+            else if(w == "insert_rand")
+                isolated([&] { runInsert(w, n, true, opt); });
+            else if(w == "search_hit")
+                isolated([&] { runSearch(w, n, true, false, opt); });
+            else if(w == "search_miss")
+                isolated([&] { runSearch(w, n, false, false, opt); });
+            else if(w == "frozen_hit")
+                isolated([&] { runSearch(w, n, true, true, opt); });
+            else if(w == "frozen_miss")
+                isolated([&] { runSearch(w, n, false, true, opt); });
+            else if(w == "range_narrow")
+                isolated([&] { runRange(w, n, opt.narrow, opt); });
+            else if(w == "range_wide")
+                isolated([&] { runRange(w, n, opt.wide, opt); });
+            else if(w == "knn") {
+                for(auto k : opt.ks)
+                    isolated([&] { runKnn(n, k, opt); });
+            } else if(w == "search_batch")
+                isolated([&] { runBatch(w, n, false, opt); });
+            else if(w == "range_batch")
+                isolated([&] { runBatch(w, n, true, opt); });
+            else if(w == "mixed") {
+                for(auto r : opt.readRatios)
+                    isolated([&] { runMixed(n, r, opt); });
+            } else if(w == "clear")
+                isolated([&] { runClear(n, opt); });
+            else if(w == "expire") {
+                isolated([&] { runExpire(n, true, opt); });
+                isolated([&] { runExpire(n, false, opt); });
+            }
+            else
+                cerr << "Error: unknown workload " << w << endl;
+        }
+    }
+    return 0;
+}
@@ -1,6 +1,9 @@
 #include "AVL_Database.hpp"
 #include "AVL_Database.cpp"
+#include "Sharded_Database.hpp"
+#include "Sharded_Database.cpp"
 #include <cassert>
+#include <cstdio>  //for remove()
 #include <iostream> //needed for cout
 using namespace std;
 
@@ -67,7 +70,393 @@ int main() {
     std::vector<Record*> nearestKeysRef2 = {r5,r6};
     assert(nearestKeys2==nearestKeysRef2);
     cout<<"Test "<<i++ <<" passed"<<endl;
-   
+
+    std::vector<Record*> nearestKeys3 = db.findKNearestKeysWithin(30, 3, 10);
+    std::vector<Record*> nearestKeysRef3 = {r3,r2};
+    assert(nearestKeys3==nearestKeysRef3);
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    assert(db.countRecords()==5);
+    assert(db.rank(40)==2);
+    assert(db.select(3)==r5);
+    assert(db.countInRange(15, 70)==3);
+    assert(db.percentile(50)==r3);
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    DatabaseStats stats = db.stats();
+    assert(stats.tree.size==5);
+    assert(stats.tree.height==3);
+    assert(stats.toJson().find("\"size\":5")!=string::npos);
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    FrozenIndex frozen = db.freeze();
+    assert(frozen.rangeQuery(10, 25)==rangeQueryRef);
+    assert(frozen.findKNearestKeys(12, 3)==nearestKeysRef);
+    assert(frozen.search(r2->key, r2->value)==r2);
+    assert(frozen.search("who are you", 56)->key=="");
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    {
+        IndexedDatabase durable;
+        assert(durable.recover("db_driver.snap", "db_driver.wal"));
+        durable.insert(r1);
+        durable.insert(r2);
+        assert(durable.checkpoint("db_driver.snap"));
+        durable.insert(r3);
+        durable.deleteRecord(r1->key, r1->value);
+    }
+    {
+        IndexedDatabase restored;
+        assert(restored.recover("db_driver.snap", "db_driver.wal"));
+        vector<Record*> restoredRecords = restored.inorderTraversal();
+        assert(restoredRecords.size()==2);
+        assert(restoredRecords[0]->key==r2->key && restoredRecords[1]->value==r3->value);
+    }
+    std::remove("db_driver.snap");
+    std::remove("db_driver.wal");
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    {
+        auto readFile = [](const char* path) {
+            string bytes;
+            if(FILE* f = fopen(path, "rb")) {
+                char chunk[4096];
+                for(size_t n; (n = fread(chunk, 1, sizeof(chunk), f)) > 0;)
+                    bytes.append(chunk, n);
+                fclose(f);
+            }
+            return bytes;
+        };
+        auto writeFile = [](const char* path, const string& bytes) {
+            FILE* f = fopen(path, "wb");
+            fwrite(bytes.data(), 1, bytes.size(), f);
+            fclose(f);
+        };
+        {
+            IndexedDatabase crashed;
+            assert(crashed.recover("db_driver.snap", "db_driver.wal"));
+            crashed.emplace("x", 1);
+            crashed.emplace("y", 2);
+            assert(crashed.syncLog() && !crashed.logFailed());
+            string oldLog = readFile("db_driver.wal");
+            assert(crashed.checkpoint("db_driver.snap"));
+            crashed.closeLog();
+            writeFile("db_driver.wal", oldLog); //as if the crash came before the log was started over
+        }
+        {
+            IndexedDatabase restarted;  //the snapshot already covers the old log, so it isn't replayed again
+            assert(restarted.recover("db_driver.snap", "db_driver.wal") && restarted.countRecords()==2);
+            restarted.emplace("z", 3);
+        }
+        IndexedDatabase again;
+        assert(again.recover("db_driver.snap", "db_driver.wal") && again.countRecords()==3);
+        assert(again.checkpoint("db_driver.snap"));
+        again.closeLog();
+        string snap = readFile("db_driver.snap");
+        uint32_t offsets[4];    //after the header and three values
+        size_t at = snap.size() - 3 - sizeof(offsets);
+        memcpy(offsets, &snap[at], sizeof(offsets));
+        assert(offsets[0]==0 && offsets[3]==3);
+        swap(offsets[1], offsets[2]);   //still within the heap, but "y" would end before it starts
+        memcpy(&snap[at], offsets, sizeof(offsets));
+        writeFile("db_driver.snap", snap);
+        MappedSnapshot mapped;
+        assert(!mapped.open("db_driver.snap"));
+        IndexedDatabase refused;    //a damaged snapshot fails recovery instead of starting empty
+        assert(!refused.recover("db_driver.snap", "db_driver.wal"));
+    }
+    std::remove("db_driver.snap");
+    std::remove("db_driver.wal");
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    vector<Record*> streamed;
+    db.rangeQuery(15, 100, [&](Record* r) { streamed.push_back(r); return streamed.size() < 2; });
+    vector<Record*> streamedRef = {r2, r3};
+    assert(streamed==streamedRef);
+    assert(*db.lower_bound(41)==r5);
+    assert(*--db.end()==r6);
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    IndexedDatabase bulkDb;
+    bulkDb.bulkLoad({r6, r1, r3});
+    bulkDb.insertBatch({r5, r2});
+    vector<Record*> bulkRef = {r1, r2, r3, r5, r6};
+    assert(bulkDb.inorderTraversal()==bulkRef);
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    bulkDb.setPersistent(true);
+    {
+        IndexedDatabase::Snapshot before = bulkDb.snapshot();
+        bulkDb.deleteRecord(r3->key, r3->value);
+        assert(before.count()==5);
+        assert(*before.find(r3->value, RecordKeyMatch{r3->key})==r3);
+        assert(bulkDb.countRecords()==4);
+    }
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    bulkDb.setKeyIndex(true);
+    assert(bulkDb.findByKey("fg")==r5);
+    assert(bulkDb.deleteByKey("a"));
+    assert(bulkDb.findByKey("a")==nullptr);
+    assert(bulkDb.countRecords()==3);
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    IndexedDatabase seqDb;   //sorted inserts and scattered deletes are the worst case for rebalancing
+    vector<Record*> seq;
+    for(int v = 0; v < 1000; v++) {
+        seq.push_back(new Record("s" + to_string(v), v));
+        seqDb.insert(seq.back());
+    }
+    assert(seqDb.checkInvariants());
+    for(int v = 0; v < 1000; v += 3)
+        seqDb.deleteRecord(seq[v]->key, seq[v]->value);
+    assert(seqDb.checkInvariants() && seqDb.countRecords()==666);
+    for(auto r : seq)
+        delete r;
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    AVLTree<long long, string> wide;    //the tree itself takes any key, payload and comparator
+    wide.insert(5000000000LL, "five");
+    wide.insert(-3, "minus three");
+    wide.insert(7, "seven");
+    assert(*wide.find(7)=="seven" && wide.find(8)==nullptr);
+    assert(wide.findKNearestKeys(0, 2)==vector<string>({"seven", "minus three"}));
+    assert(wide.erase(-3, [](const string&) { return true; }).value()=="minus three");
+    assert(wide.checkInvariants() && wide.count()==2);
+    AVLTree<int, int, greater<int>> descending; //nearest keys measure the same gap whichever way the tree is ordered
+    for(int v = 0; v < 10; v++)
+        descending.insert(v, v);
+    vector<int> near = descending.findKNearestKeys(5, 2);
+    sort(near.begin(), near.end());
+    assert(near==vector<int>({4, 6}) && descending.findKNearestKeysWithin(0, 3, 1)==vector<int>({1}));
+    near = descending.findKNearestKeys(9, 3);
+    sort(near.begin(), near.end());
+    assert(near==vector<int>({6, 7, 8}));
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    ShardedDatabase sharded(4, 0, 40000);    //every record lands in the first shard until rebalancing spreads them
+    IndexedDatabase single;
+    vector<Record*> spread;
+    for(int v = 0; v < 3000; v++) {
+        spread.push_back(new Record("k" + to_string(v), v));
+        sharded.insert(spread.back());
+        single.insert(spread.back());
+    }
+    vector<int> sizes = sharded.shardSizes();
+    assert(*max_element(sizes.begin(), sizes.end()) <= 1500);
+    assert(sharded.countRecords()==3000 && sharded.inorderTraversal().size()==3000);
+    assert(sharded.rangeQuery(100, 2900)==single.rangeQuery(100, 2900));
+    assert(sharded.findKNearestKeys(1500, 7)==single.findKNearestKeys(1500, 7));
+    sharded.deleteRecord(spread[0]->key, spread[0]->value);
+    assert(sharded.countRecords()==2999);
+    ShardedDatabase repeated(4);    //one value can't be split, so the boundaries stay put instead of moving per insert
+    vector<Record*> same;
+    for(int v = 0; v < 20000; v++) {
+        same.push_back(new Record("s" + to_string(v), 7));
+        repeated.insert(same.back());
+    }
+    sizes = repeated.shardSizes();
+    assert(*max_element(sizes.begin(), sizes.end())==20000 && repeated.rangeQuery(7, 7).size()==20000);
+    ShardedDatabase narrow(8, 2, 0);    //reversed range with fewer values than shards: one shard per value
+    assert(narrow.shardCount()==3);
+    vector<Record*> few;
+    for(int v = -2; v < 5; v++) {
+        few.push_back(new Record("n" + to_string(v), v));
+        narrow.insert(few.back());
+    }
+    assert(narrow.shardSizes()==vector<int>({3, 1, 3}) && narrow.rangeQuery(-5, 10)==few);
+    assert(narrow.findKNearestKeys(1, 2).size()==2 && narrow.find("n4", 4)==few.back());
+    for(auto r : few)
+        delete r;
+    for(auto r : same)
+        delete r;
+    for(auto r : spread)
+        delete r;
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    IndexedDatabase totals;
+    vector<Record*> amounts;
+    for(int v = 1; v <= 100; v++) {
+        amounts.push_back(new Record("a" + to_string(v), v * 10));
+        totals.insert(amounts.back());
+    }
+    totals.deleteRecord("a50", 500);
+    RangeAggregate agg = totals.aggregateRange(255, 1000);  //values 260..1000 without 500
+    assert(agg.count==74 && agg.sum==47250 - 500 && agg.min==260 && agg.max==1000);
+    assert(totals.aggregateRange(1001, 2000).count==0 && totals.aggregateRange(20, 10).sum==0);
+    assert(totals.aggregateRange(500, 500).count==0 && totals.aggregateRange(0, 5000).count==99);
+    assert(totals.checkInvariants());   //covers the summary in every node
+    for(auto r : amounts)
+        delete r;
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    IndexedDatabase batched;
+    vector<Record*> rows;
+    for(int v = 0; v < 500; v++) {
+        rows.push_back(new Record("row" + to_string(v), v * 2 % 500));  //every even value twice
+        batched.insert(rows.back());
+    }
+    vector<Record*> hits = batched.searchBatch({{"row300", 100}, {"row3", 6}, {"nope", 6}, {"row50", 100}, {"row1", 3}});
+    IndexedDatabase emptyDb;    //keys that do exist elsewhere, so every probe reaches the (empty) tree
+    assert(emptyDb.searchBatch({{"row300", 100}, {"row3", 6}})==vector<Record*>({nullptr, nullptr}));
+    assert(emptyDb.rangeQueryBatch({{0, 10}, {5, 1}})==vector<vector<Record*>>(2));
+    assert(hits==vector<Record*>({rows[300], rows[3], nullptr, rows[50], nullptr}));
+    vector<pair<int, int>> ranges = {{400, 420}, {0, 9}, {5, 30}, {30, 5}, {498, 900}, {401, 401}};
+    vector<vector<Record*>> batch = batched.rangeQueryBatch(ranges);
+    vector<Record*> all = batched.inorderTraversal();
+    for(size_t r = 0; r < ranges.size(); r++) {
+        vector<Record*> expected;
+        copy_if(all.begin(), all.end(), back_inserter(expected), [&](Record* x) { return x->value>=ranges[r].first && x->value<=ranges[r].second; });
+        assert(batch[r]==expected);
+    }
+    for(auto r : rows)
+        delete r;
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    IndexedDatabase scores;
+    vector<Record*> players;
+    for(int p = 0; p < 600; p++) {
+        players.push_back(new Record("player" + to_string(p * 7919 % 600), p % 3 ? 90 : p % 40));  //two thirds score 90
+        scores.insert(players.back());
+    }
+    for(auto r : players)
+        assert(scores.search(r->key, r->value)==r);
+    for(size_t p = 0; p < players.size(); p += 2)
+        scores.deleteRecord(players[p]->key, players[p]->value);
+    for(size_t p = 0; p < players.size(); p++)
+        assert(scores.search(players[p]->key, players[p]->value)->key.empty()==(p % 2==0));
+    assert(scores.checkInvariants() && scores.countEqual(90)==200 && scores.countEqual(91)==0);
+    auto tied = scores.equalRange(90);
+    assert(distance(tied.first, tied.second)==200);
+    assert(is_sorted(tied.first, tied.second, [](const Record* a, const Record* b) { return a->key < b->key; }));
+    assert(scores.rangeQuery(90, 90).size()==200 && (*tied.first)->value==90);
+    vector<pair<string, int>> lookups;  //every player, kept or deleted, then keys missing from the run
+    for(auto r : players)
+        lookups.push_back({r->key, r->value});
+    lookups.push_back({"player", 90});
+    lookups.push_back({"zzz", 90});
+    vector<Record*> looked = scores.searchBatch(lookups);
+    FrozenIndex frozenScores = scores.freeze();
+    assert(scores.writeSnapshot("db_driver.snap"));
+    MappedSnapshot mappedScores;
+    assert(mappedScores.open("db_driver.snap"));
+    for(size_t p = 0; p < lookups.size(); p++) {
+        Record* expect = scores.find(lookups[p].first, lookups[p].second);
+        assert(looked[p]==expect && frozenScores.find(lookups[p].first, lookups[p].second)==expect);
+        assert(mappedScores.contains(lookups[p].first, lookups[p].second)==(expect!=nullptr));
+    }
+    mappedScores.close();
+    std::remove("db_driver.snap");
+    for(auto r : players)
+        delete r;
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    {
+        IndexedDatabase owner;
+        Record* made = owner.emplace("made", 5);
+        Record* moved = owner.insert(Record("moved", 6));
+        assert(owner.find("made", 5)==made && owner.find("moved", 6)==moved && moved->key=="moved");
+        assert(owner.find("made", 6)==nullptr && owner.find("nobody", 5)==nullptr);
+        Record* miss = owner.search("nobody", 5);
+        assert(miss->key.empty() && miss->value==0 && owner.search("nobody", 7)==miss);  //same empty record every miss
+        owner.deleteRecord("made", 5);  //frees the owned record
+        assert(owner.countRecords()==1);
+    }   //moved is freed with owner
+    {
+        IndexedDatabase churn;  //owned records removed in persistent mode outlive the snapshots that can see them
+        churn.setPersistent(true);
+        for(int v = 0; v < 100; v++)
+            churn.emplace("c" + to_string(v), v);
+        {
+            IndexedDatabase::Snapshot pinned = churn.snapshot();
+            churn.deleteRecord("c5", 5);
+            churn.deleteRange(10, 19);
+            churn.clearDatabase();
+            assert(pinned.count()==100 && pinned.rangeQuery(5, 5)[0]->key=="c5");
+            assert(pinned.rangeQuery(10, 19).size()==10 && (*pinned.select(99))->key=="c99");
+        }
+        for(int round = 0; round < 50; round++) {   //freed as writes go by, nothing waits for the destructor
+            churn.emplace("r", round);
+            churn.deleteRecord("r", round);
+        }
+        assert(churn.countRecords()==0);
+    }
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    IndexedDatabase tenants;
+    vector<Record*> visits;
+    for(int v = 0; v < 1000; v++) { //ten long keys repeated across many values
+        visits.push_back(new Record("tenant-with-a-long-descriptive-name-" + to_string(v % 10), v / 3));
+        tenants.insert(visits.back());
+    }
+    for(auto r : visits)
+        assert(tenants.find(r->key, r->value)==r && r->key.size()==37);
+    assert(tenants.find("tenant-never-stored-anywhere-at-all-x", 5)==nullptr);
+    tenants.deleteRecord("tenant-with-a-long-descriptive-name-4", 1);
+    assert(tenants.find(visits[4]->key, 1)==nullptr && tenants.countRecords()==999 && tenants.checkInvariants());
+    assert(visits[0]->key==visits[10]->key && visits[0]->key!=visits[1]->key && visits[0]->key < visits[1]->key);
+#ifdef AVL_INTERNED_KEYS
+    assert(sizeof(Record) <= 12);   //id, length and value, the key bytes are stored once in the arena
+    size_t keysBefore = KeyArena::instance().count(), bytesBefore = KeyArena::instance().bytes();
+    for(int round = 0; round < 3; round++) {    //a key leaves the arena with its last record
+        vector<Record*> churned;
+        for(int v = 0; v < 1000; v++)
+            churned.push_back(new Record("churn" + to_string(round * 1000 + v), v));
+        Record copy = *churned[0];
+        assert(KeyArena::instance().count()==keysBefore + 1000);
+        for(auto r : churned)
+            delete r;
+        assert(KeyArena::instance().count()==keysBefore + 1 && copy.key=="churn" + to_string(round * 1000));
+    }
+    assert(KeyArena::instance().count()==keysBefore && KeyArena::instance().bytes()==bytesBefore);
+#endif
+    for(auto r : visits)
+        delete r;
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
+    {
+        IndexedDatabase window;
+        assert(window.recover("db_driver.snap", "db_driver.wal"));
+        window.setKeyIndex(true);
+        for(int v = 0; v < 1000; v++)
+            window.emplace("w" + to_string(v), v / 2);  //owned, two records per value
+        assert(window.deleteRange(0, 49)==100 && window.countRecords()==900);
+        assert(window.findByKey("w99")==nullptr && window.findByKey("w100")->value==50);
+        unique_ptr<IndexedDatabase> moved = window.extractRange(200, 249);
+        assert(moved->countRecords()==100 && window.countRecords()==800 && window.countInRange(200, 249)==0);
+        assert(moved->find("w400", 200)!=nullptr && moved->findByKey("w499")->value==249 && window.findByKey("w400")==nullptr);
+        window.deleteRange(300, 299);   //empty range, nothing to do
+        assert(window.checkInvariants() && moved->checkInvariants() && window.countRecords()==800);
+        window.merge(*moved);   //the records move back, owned by window again
+        assert(moved->countRecords()==0 && window.countRecords()==900 && window.findByKey("w400")->value==200);
+        assert(window.checkInvariants() && window.aggregateRange(200, 249).sum==22450);
+        window.deleteRange(400, 499);
+    }
+    {
+        IndexedDatabase replayed;   //the range deletes come back from the log
+        assert(replayed.recover("db_driver.snap", "db_driver.wal"));
+        assert(replayed.countRecords()==700 && replayed.countInRange(0, 49)==0 && replayed.countInRange(400, 499)==0);
+    }
+    std::remove("db_driver.snap");
+    std::remove("db_driver.wal");
+    {
+        IndexedDatabase small, busy;    //busy's nodes carry version stamps small's later writes would reach
+        small.setPersistent(true);
+        busy.setPersistent(true);
+        for(int v = 0; v < 3; v++)
+            small.emplace("s" + to_string(v), v);
+        for(int v = 1000; v < 1300; v++)
+            busy.emplace("b" + to_string(v), v);
+        small.merge(busy);
+        IndexedDatabase::Snapshot pinned = small.snapshot();
+        vector<Record*> seen = pinned.inorderTraversal();
+        for(int v = 1000; v < 1300; v += 2)    //writes into the absorbed range copy its nodes instead of reusing them
+            small.deleteRecord("b" + to_string(v), v);
+        assert(pinned.inorderTraversal()==seen && pinned.count()==303 && seen.size()==303);
+        assert(small.countRecords()==153 && small.checkInvariants());
+    }
+    cout<<"Test "<<i++ <<" passed"<<endl;
+
     // for (auto record : nearestKeys2) {
     //     std::cout << record->key << ": " << record->value << "\n";
     // }